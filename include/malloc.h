@@ -0,0 +1,117 @@
+/**
+ * @file malloc.h
+ * @brief Header file for memory allocation extensions.
+ * 
+ * This file contains declarations for memory allocation functions that are
+ * not part of the C standard, such as memalign, heap tuning, profiling and
+ * tracing, object pools and arenas.
+ * The standard functions are declared in stdlib.h.
+ */
+
+#ifndef _MALLOC_H
+#define _MALLOC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+#include <stdlib.h>
+
+#define M_TRIM_THRESHOLD -1
+#define M_TOP_PAD -2
+
+/**
+ * @brief Statistics about the memory used by the allocator.
+ */
+struct mallinfo2 {
+	size_t arena; /**< Bytes in heap regions. */
+	size_t ordblks; /**< Number of free blocks. */
+	size_t smblks; /**< Number of fast bin blocks. */
+	size_t hblks; /**< Number of directly mapped blocks. */
+	size_t hblkhd; /**< Bytes in directly mapped blocks. */
+	size_t usmblks; /**< Peak bytes in use. */
+	size_t fsmblks; /**< Bytes in fast bin blocks. */
+	size_t uordblks; /**< Bytes allocated from heap regions. */
+	size_t fordblks; /**< Free bytes in heap regions. */
+	size_t keepcost; /**< Free bytes at the end of the heap. */
+	size_t maxfree; /**< Size of the largest free block. */
+	size_t expansions; /**< Number of times the heap was expanded. */
+};
+
+#define HEAP_PROFILE_DEPTH 16
+
+/**
+ * @brief Allocations sampled by the heap profiler at one call stack.
+ */
+typedef struct {
+	size_t samples; /**< Number of sampled allocations. */
+	size_t bytes; /**< Bytes in sampled allocations. */
+	size_t live_samples; /**< Number of sampled allocations not freed. */
+	size_t live_bytes; /**< Bytes in sampled allocations not freed. */
+	size_t depth; /**< Number of return addresses in frames. */
+	void *frames[HEAP_PROFILE_DEPTH]; /**< Return addresses. */
+} heap_profile_site_t;
+
+#define HEAP_TRACE_MALLOC 1
+#define HEAP_TRACE_CALLOC 2
+#define HEAP_TRACE_REALLOC 3
+#define HEAP_TRACE_ALIGNED 4
+#define HEAP_TRACE_FREE 5
+
+/**
+ * @brief A call to the allocator logged by the tracer.
+ */
+typedef struct {
+	unsigned long long time; /**< Time stamp counter when it was logged. */
+	int op; /**< One of the HEAP_TRACE_* operations. */
+	size_t size; /**< Requested size, or 0 for free. */
+	void *ptr; /**< Pointer that was returned or freed. */
+	void *old; /**< Pointer passed to realloc. */
+	size_t alignment; /**< Alignment of an aligned allocation. */
+} heap_trace_event_t;
+
+typedef struct _pool pool_t;
+typedef struct _arena arena_t;
+
+void *memalign(size_t alignment, size_t size);
+size_t malloc_usable_size(void *ptr);
+size_t malloc_batch(size_t size, size_t n, void **out);
+void free_batch(void **ptrs, size_t n);
+
+int malloc_trim(size_t pad);
+void heap_thread_exit(void);
+int mallopt(int param, int value);
+struct mallinfo2 mallinfo2(void);
+int heap_check(void);
+void heap_set_error_handler(void (*handler)(const char *message, void *ptr));
+
+void heap_profile_start(size_t interval);
+void heap_profile_stop(void);
+void heap_profile_reset(void);
+size_t heap_profile_dump(void (*callback)(const heap_profile_site_t *site,
+					  void *arg),
+			 void *arg);
+
+void heap_trace_start(void);
+void heap_trace_stop(void);
+size_t heap_trace_dump(void (*callback)(const heap_trace_event_t *event,
+					void *arg),
+		       void *arg);
+
+pool_t *pool_create(size_t size);
+void *pool_alloc(pool_t *pool);
+void pool_free(pool_t *pool, void *ptr);
+void pool_destroy(pool_t *pool);
+
+arena_t *arena_create(size_t chunk_size);
+void *arena_alloc(arena_t *arena, size_t size);
+void *arena_mark(arena_t *arena);
+void arena_rewind(arena_t *arena, void *mark);
+void arena_reset(arena_t *arena);
+void arena_destroy(arena_t *arena);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // _MALLOC_H
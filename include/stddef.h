@@ -20,7 +20,13 @@ extern "C" {
 
 typedef unsigned long size_t;
 typedef long ptrdiff_t;
-typedef unsigned int max_align_t;
+
+typedef struct {
+	long long __max_align_ll
+		__attribute__((__aligned__(__alignof__(long long))));
+	long double __max_align_ld
+		__attribute__((__aligned__(__alignof__(long double))));
+} max_align_t;
 
 #ifndef __cplusplus
 typedef short wchar_t;
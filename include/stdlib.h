@@ -48,8 +48,20 @@ void exit(int status);
 
 void *malloc(size_t size);
 
+void *calloc(size_t nmemb, size_t size);
+
 void free(void *ptr);
 
+void free_sized(void *ptr, size_t size);
+
+void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+
+void *realloc(void *ptr, size_t size);
+
+void *aligned_alloc(size_t alignment, size_t size);
+
+int posix_memalign(void **memptr, size_t alignment, size_t size);
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
@@ -0,0 +1,164 @@
+/**
+ * @file arena.c
+ * @brief Arena allocation functions.
+ *
+ * This file contains implementations of arena allocation functions. An arena
+ * hands out memory by bumping a pointer through chunks taken from the heap,
+ * and releases all of it at once, which suits objects that die together.
+ */
+
+#include <malloc.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_ALIGNMENT _Alignof(max_align_t)
+#define ARENA_CHUNK_SIZE 0x10000
+
+typedef struct _arena_chunk arena_chunk;
+struct _arena_chunk {
+	arena_chunk *previous;
+	uintptr_t end;
+	max_align_t data[];
+};
+
+struct _arena {
+	size_t chunk_size;
+	arena_chunk *chunk;
+	uintptr_t ptr;
+};
+
+/**
+ * @brief Frees the chunks of an arena that were added after a chunk.
+ *
+ * @param arena Pointer to the arena.
+ * @param chunk Pointer to the chunk to keep, or NULL to free all chunks.
+ */
+static void arena_free_chunks(arena_t *arena, arena_chunk *chunk)
+{
+	arena_chunk *previous;
+
+	while (arena->chunk != chunk) {
+		previous = arena->chunk->previous;
+		free(arena->chunk);
+		arena->chunk = previous;
+	}
+}
+
+/**
+ * @brief Creates an arena.
+ *
+ * @param chunk_size The size of the chunks taken from the heap, or 0 to use
+ *        the default size.
+ * @return A pointer to the new arena, or NULL if the allocation fails.
+ */
+arena_t *arena_create(size_t chunk_size)
+{
+	arena_t *arena = malloc(sizeof(arena_t));
+	if (!arena)
+		return NULL;
+
+	arena->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_SIZE;
+	arena->chunk = NULL;
+	arena->ptr = 0;
+	return arena;
+}
+
+/**
+ * @brief Allocates memory from an arena.
+ *
+ * The memory is taken from the current chunk by bumping a pointer. A new
+ * chunk is added when the current one is exhausted.
+ *
+ * @param arena Pointer to the arena.
+ * @param size The size of the memory to allocate.
+ * @return A pointer to the allocated memory, or NULL if the allocation fails.
+ */
+void *arena_alloc(arena_t *arena, size_t size)
+{
+	arena_chunk *chunk;
+	size_t chunk_size;
+	uintptr_t ptr;
+
+	if (size > SIZE_MAX / 2)
+		return NULL;
+	size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+	if (arena->chunk && arena->chunk->end - arena->ptr >= size) {
+		ptr = arena->ptr;
+		arena->ptr += size;
+		return (void *)ptr;
+	}
+
+	chunk_size = sizeof(arena_chunk) + size;
+	if (chunk_size < arena->chunk_size)
+		chunk_size = arena->chunk_size;
+	if (!(chunk = malloc(chunk_size)))
+		return NULL;
+
+	chunk->previous = arena->chunk;
+	chunk->end = (uintptr_t)chunk + chunk_size;
+	arena->chunk = chunk;
+	arena->ptr = (uintptr_t)chunk->data + size;
+	return chunk->data;
+}
+
+/**
+ * @brief Returns a mark for the current state of an arena.
+ *
+ * @param arena Pointer to the arena.
+ * @return A mark to pass to arena_rewind().
+ */
+void *arena_mark(arena_t *arena)
+{
+	return (void *)arena->ptr;
+}
+
+/**
+ * @brief Frees all memory allocated from an arena after a mark was taken.
+ *
+ * @param arena Pointer to the arena.
+ * @param mark A mark returned by arena_mark().
+ */
+void arena_rewind(arena_t *arena, void *mark)
+{
+	arena_chunk *chunk = arena->chunk;
+
+	while (chunk && ((uintptr_t)mark < (uintptr_t)chunk->data ||
+			 (uintptr_t)mark > chunk->end))
+		chunk = chunk->previous;
+
+	arena_free_chunks(arena, chunk);
+	arena->ptr = (uintptr_t)mark;
+}
+
+/**
+ * @brief Frees all memory allocated from an arena.
+ *
+ * The first chunk of the arena is kept for reuse, so an arena that is reset
+ * after every request does not need to take memory from the heap again.
+ *
+ * @param arena Pointer to the arena.
+ */
+void arena_reset(arena_t *arena)
+{
+	arena_chunk *chunk = arena->chunk;
+
+	if (!chunk)
+		return;
+	while (chunk->previous)
+		chunk = chunk->previous;
+
+	arena_free_chunks(arena, chunk);
+	arena->ptr = (uintptr_t)chunk->data;
+}
+
+/**
+ * @brief Destroys an arena and frees all memory allocated from it.
+ *
+ * @param arena Pointer to the arena.
+ */
+void arena_destroy(arena_t *arena)
+{
+	arena_free_chunks(arena, NULL);
+	free(arena);
+}
@@ -0,0 +1,68 @@
+/**
+ * @file linux.c
+ * @brief Linux stand-in for the kernel interface.
+ *
+ * This file implements the kernel interface used by c_core on top of Linux
+ * system calls, so that the library can be built and tested on a Linux host.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LINUX_SYS_MMAP 9
+#define LINUX_SYS_MUNMAP 11
+
+#define LINUX_PROT_READ 0x1
+#define LINUX_PROT_WRITE 0x2
+#define LINUX_MAP_PRIVATE 0x02
+#define LINUX_MAP_ANONYMOUS 0x20
+
+/**
+ * @brief Performs a Linux system call with up to six arguments.
+ *
+ * @param number The system call number.
+ * @return The raw return value of the system call.
+ */
+static long linux_syscall(long number, long a1, long a2, long a3, long a4,
+			  long a5, long a6)
+{
+	register long r10 __asm__("r10") = a4;
+	register long r8 __asm__("r8") = a5;
+	register long r9 __asm__("r9") = a6;
+	long ret;
+
+	__asm__ volatile("syscall"
+			 : "=a"(ret)
+			 : "a"(number), "D"(a1), "S"(a2), "d"(a3), "r"(r10),
+			   "r"(r8), "r"(r9)
+			 : "rcx", "r11", "memory");
+	return ret;
+}
+
+/**
+ * @brief Maps zeroed pages into the address space of the process.
+ *
+ * @param size The size of the region in bytes, a multiple of the page size.
+ * @return A pointer to the start of the region, or NULL if the mapping fails.
+ */
+void *_map_pages(size_t size)
+{
+	long address = linux_syscall(LINUX_SYS_MMAP, 0, (long)size,
+				     LINUX_PROT_READ | LINUX_PROT_WRITE,
+				     LINUX_MAP_PRIVATE | LINUX_MAP_ANONYMOUS,
+				     -1, 0);
+	if (address < 0 && address > -4096)
+		return NULL;
+	return (void *)address;
+}
+
+/**
+ * @brief Unmaps pages from the address space of the process.
+ *
+ * @param address The start of the region, aligned to the page size.
+ * @param size The size of the region in bytes, a multiple of the page size.
+ */
+void _unmap_pages(void *address, size_t size)
+{
+	linux_syscall(LINUX_SYS_MUNMAP, (long)address, (long)size, 0, 0, 0, 0);
+}
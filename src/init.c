@@ -10,7 +10,20 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-void heap_init(void);
+/*
+ * SYSCALL_MAP and SYSCALL_UNMAP are new system call numbers, which the kernel
+ * has to implement before the heap can grow. Both take a pointer to a struct
+ * syscall_region and return 0 on success or a negative error code.
+ *
+ * SYSCALL_MAP maps size bytes of zeroed, writable pages anywhere in the
+ * address space of the process and stores their start in address. The size
+ * is a multiple of the page size. SYSCALL_UNMAP unmaps the pages from
+ * address to address + size, which may be part of an earlier mapping.
+ */
+struct syscall_region {
+	void *address;
+	size_t size;
+};
 
 enum syscall_type {
 	SYSCALL_EXIT,
@@ -20,21 +33,54 @@ enum syscall_type {
 	SYSCALL_PUSH,
 	SYSCALL_PEEK,
 	SYSCALL_POP,
+	SYSCALL_MAP,
+	SYSCALL_UNMAP,
 };
 
 /**
  * @brief Initializes the standard library.
  * 
- * This function initializes the standard library by setting up the heap.
- * It should be called before using any other standard library functions.
+ * This function initializes the standard library. It should be called
+ * before using any other standard library functions. The heap is set up on
+ * the first allocation, so that programs that never allocate start faster.
  */
 void init_std(void)
 {
-	heap_init();
 }
 
 void _fini(void);
-[[noreturn]] int64_t _syscall(int, void *);
+int64_t _syscall(int, void *);
+
+/**
+ * @brief Maps zeroed pages into the address space of the process.
+ *
+ * This function asks the kernel for a new region of memory, which is used
+ * by the allocator to expand the heap.
+ *
+ * @param size The size of the region in bytes, a multiple of the page size.
+ * @return A pointer to the start of the region, or NULL if the mapping fails.
+ */
+void *_map_pages(size_t size)
+{
+	struct syscall_region region = { NULL, size };
+
+	if (_syscall(SYSCALL_MAP, &region) < 0)
+		return NULL;
+	return region.address;
+}
+
+/**
+ * @brief Unmaps pages from the address space of the process.
+ *
+ * @param address The start of the region, aligned to the page size.
+ * @param size The size of the region in bytes, a multiple of the page size.
+ */
+void _unmap_pages(void *address, size_t size)
+{
+	struct syscall_region region = { address, size };
+
+	_syscall(SYSCALL_UNMAP, &region);
+}
 
 /**
  * @brief Exits the program with the specified status code.
@@ -7,170 +7,3386 @@
  * allocation in the program.
  */
 
+#include <errno.h>
+#include <malloc.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
+/*
+ * Every block starts with a header holding the size of its payload, with the
+ * low bits used as flags. Free blocks also store their size in a footer at
+ * the end of the payload, so that the block after them can find its previous
+ * neighbour. Each region of the heap ends with a used block of size zero.
+ *
+ * Headers are placed 8 bytes below a multiple of HEAP_ALIGNMENT and blocks
+ * span a multiple of HEAP_ALIGNMENT, so every payload is aligned for any
+ * type without padding between blocks.
+ */
 typedef struct _heap_block heap_block;
 struct _heap_block {
-	bool used;
-	size_t size;
+	size_t header;
+};
+
+/*
+ * Free blocks keep their free list links at the start of their payload and
+ * their footer at the end, so every block must be able to hold them once it
+ * is freed.
+ */
+typedef struct _heap_free_links heap_free_links;
+struct _heap_free_links {
 	heap_block *previous;
 	heap_block *next;
 };
 
+#define HEAP_ALIGNMENT (2 * sizeof(heap_block))
+#define HEAP_MIN_SIZE (sizeof(heap_free_links) + sizeof(size_t))
+
+_Static_assert(HEAP_ALIGNMENT == _Alignof(max_align_t),
+	       "heap payloads must be aligned for max_align_t");
+
+#define HEAP_USED 0x1
+#define HEAP_PREVIOUS_USED 0x2
+#define HEAP_FLAGS 0x7
+
+/*
+ * A clean block has a zero payload, apart from the free list or tree links
+ * and the footer it may hold. Memory from the kernel starts out clean, and
+ * blocks lose the flag once they are handed out by malloc().
+ */
+#define HEAP_CLEAN 0x4
+
+/*
+ * Payload sizes are always sizeof(heap_block) above a multiple of
+ * HEAP_ALIGNMENT, so this bit is set in the header of every heap block.
+ * Objects in slabs are preceded by a tag without it instead, which holds the
+ * offset of the object from the block of its slab. Blocks mapped directly
+ * from the kernel have a tag with HEAP_MAPPED set.
+ */
+#define HEAP_SIZE_BIT sizeof(heap_block)
+#define HEAP_MAPPED 0x2
+
+/*
+ * Size classes: blocks smaller than HEAP_SMALL_LIMIT get one exact bin per
+ * HEAP_ALIGNMENT bytes. Larger free blocks are kept in a red-black tree
+ * ordered by size and address, so that the best fitting block is found in
+ * logarithmic time.
+ *
+ * With HEAP_TLSF, larger blocks are grouped in power-of-two bins instead,
+ * each split further into HEAP_TLSF_SUBBINS bins, and requests are rounded
+ * up to the next bin so that any block of the first non-empty bin fits.
+ * Together with a summary bitmap holding one bit per word of the bin
+ * bitmap, this bounds the time to find a free block by two bit scans.
+ */
+#define HEAP_SMALL_LIMIT 0x200
+#define HEAP_SMALL_BINS (HEAP_SMALL_LIMIT / HEAP_ALIGNMENT)
+#ifdef HEAP_TLSF
+#define HEAP_TLSF_SHIFT 4
+#define HEAP_TLSF_SUBBINS (1 << HEAP_TLSF_SHIFT)
+#define HEAP_BIN_COUNT 960
+#else
+#define HEAP_BIN_COUNT 64
+#endif
+#define HEAP_BIN_WORDS (HEAP_BIN_COUNT / 64)
+
+_Static_assert(HEAP_SMALL_BINS <= HEAP_BIN_COUNT,
+	       "every small bin needs a bit in the first bitmap word");
+
+/*
+ * Without TLSF, freed blocks below HEAP_FAST_LIMIT that are too large for the
+ * pools are not merged with their neighbours right away. They stay marked as
+ * used in a fast bin for their exact size, so that the next request of that
+ * size takes one back instead of splitting a free block again. Fast bins are
+ * merged into the heap when a request finds no free block, and when the heap
+ * is trimmed.
+ *
+ * The fast bins hold at most HEAP_FAST_MAX bytes, and blocks beyond that are
+ * merged right away. Fast blocks also keep the free memory around them from
+ * being trimmed, so a block that would grow to HEAP_FAST_CONSOLIDATE bytes
+ * with its free neighbours, such as one at the end of the heap, is merged
+ * right away as well, and all fast bins are merged with it before the heap
+ * is trimmed.
+ */
+#ifndef HEAP_TLSF
+#define HEAP_FAST_LIMIT 0x1000
+#define HEAP_FAST_BINS ((HEAP_FAST_LIMIT - HEAP_SMALL_LIMIT) / HEAP_ALIGNMENT)
+#define HEAP_FAST_MAX 0x40000
+#define HEAP_FAST_CONSOLIDATE 0x10000
+#endif
+
+/*
+ * The heap grows in chunks that double with every expansion, from
+ * HEAP_MIN_CHUNK up to HEAP_MAX_CHUNK, so that large workloads need few
+ * mapping system calls.
+ */
+#define HEAP_PAGE_SIZE 0x1000
+#define HEAP_MIN_CHUNK 0x10000
+#define HEAP_MAX_CHUNK 0x1000000
+
+/*
+ * Allocations of at least HEAP_MAP_THRESHOLD bytes get their own mapping,
+ * which is returned to the kernel as soon as they are freed. With HEAP_TLSF,
+ * they come from the heap like smaller blocks instead, because mapping and
+ * unmapping pages does not take bounded time.
+ */
+#ifdef HEAP_TLSF
+#define HEAP_MAP_THRESHOLD SIZE_MAX
+#else
+#define HEAP_MAP_THRESHOLD 0x40000
+#endif
+
+/*
+ * When the free block at the end of the heap grows past the trim threshold,
+ * the whole pages after the first HEAP_TOP_PAD bytes of it are returned to
+ * the kernel. Both can be changed with mallopt. With HEAP_TLSF, freeing
+ * memory never trims the heap, and it is only trimmed by malloc_trim.
+ */
+#define HEAP_TRIM_THRESHOLD 0x100000
+#define HEAP_TOP_PAD HEAP_MIN_CHUNK
+
+/*
+ * Each thread caches up to TCACHE_COUNT freed blocks per small size class.
+ * Empty caches are refilled and full caches are flushed TCACHE_BATCH blocks
+ * at a time, so the shared heap is locked once per batch.
+ *
+ * Per-thread caches live in thread-local storage, which the runtime has to
+ * set up for every thread, so they are only built with HEAP_THREAD_CACHE.
+ * Otherwise all threads share a single cache that is only used while the
+ * heap lock is held.
+ */
+#define TCACHE_COUNT 16
+#define TCACHE_BATCH 8
+
+/*
+ * Up to HEAP_REMOTE_QUEUES threads at a time get a queue for objects freed
+ * by other threads. Threads beyond that cache foreign objects themselves.
+ */
+#define HEAP_REMOTE_QUEUES 64
+
+/*
+ * Slabs take one page from the heap, or more for pools of objects too large
+ * to fit at least HEAP_SLAB_OBJECTS of them in a page.
+ */
+#define HEAP_SLAB_SIZE (HEAP_PAGE_SIZE - sizeof(heap_block))
+#define HEAP_SLAB_OBJECTS 8
+
+#define FREE_LINKS(block) \
+	((heap_free_links *)((uintptr_t)(block) + sizeof(heap_block)))
+
+/*
+ * Large free blocks keep their tree links after their free list links.
+ */
+typedef struct _heap_tree_links heap_tree_links;
+struct _heap_tree_links {
+	heap_block *left;
+	heap_block *right;
+	heap_block *parent;
+	bool red;
+};
+
+#define TREE_LINKS(block)                                             \
+	((heap_tree_links *)((uintptr_t)(block) + sizeof(heap_block) + \
+			     sizeof(heap_free_links)))
+
+#ifdef HEAP_TLSF
+#define HEAP_FREE_METADATA sizeof(heap_free_links)
+#else
+#define HEAP_FREE_METADATA \
+	(sizeof(heap_free_links) + sizeof(heap_tree_links))
+#endif
+
 static uintptr_t heap_start;
 static uintptr_t heap_end;
-static heap_block *first_block;
-static heap_block *last_block;
+static heap_block *heap_tail;
+
+/*
+ * The pages of the regions added to the heap and of mapped blocks are marked
+ * in a page map, a three-level radix tree indexed by page number, so that a
+ * pointer can be checked without taking the heap lock. Its nodes are mapped
+ * when they are first needed and never unmapped, so it can be read while it
+ * changes. The first region of the heap need not be aligned to pages, so it
+ * is checked against its bounds instead.
+ */
+#define HEAP_PAGEMAP_ROOT_BITS 12
+#define HEAP_PAGEMAP_NODE_BITS 9
+#define HEAP_PAGEMAP_LEAF_BITS 15
+#define HEAP_PAGEMAP_PAGES                                \
+	((uintptr_t)1 << (HEAP_PAGEMAP_ROOT_BITS +         \
+			  HEAP_PAGEMAP_NODE_BITS + HEAP_PAGEMAP_LEAF_BITS))
+
+static void *_Atomic heap_pagemap;
+static uintptr_t heap_first_start;
+static uintptr_t heap_first_end;
+
+static size_t heap_trim_threshold = HEAP_TRIM_THRESHOLD;
+static size_t heap_top_pad = HEAP_TOP_PAD;
+
+/*
+ * Every region of the heap starts with a record linking it to the region
+ * added before it. The first block of a region follows the record and a
+ * padding word that keeps payloads aligned.
+ */
+typedef struct _heap_region heap_region;
+struct _heap_region {
+	heap_region *previous;
+	size_t size;
+};
+
+#define HEAP_REGION_OFFSET (sizeof(heap_region) + sizeof(heap_block))
+
+static heap_region *heap_regions;
+
+/*
+ * Running totals of the heap, kept up to date under the heap lock so that
+ * reading them never requires walking the heap.
+ */
+typedef struct _heap_stats heap_stats;
+struct _heap_stats {
+	size_t region_size;
+	size_t free_size;
+	size_t free_count;
+	size_t mapped_size;
+	size_t mapped_count;
+	size_t fast_size;
+	size_t fast_count;
+	size_t peak;
+	size_t expansions;
+};
+
+static heap_stats heap_totals;
+
+static heap_block *heap_bins[HEAP_BIN_COUNT];
+static uint64_t heap_bin_map[HEAP_BIN_WORDS];
+#ifdef HEAP_TLSF
+static uint64_t heap_bin_summary;
+#else
+static heap_block *heap_tree;
+static heap_block *heap_fast_bins[HEAP_FAST_BINS];
+#endif
+
+static size_t heap_chunk_size = HEAP_MIN_CHUNK;
+
+static atomic_flag heap_lock = ATOMIC_FLAG_INIT;
+
+/*
+ * Objects freed by a thread other than the one that cached them are pushed
+ * on the remote queue of that thread without taking the heap lock, and the
+ * owner moves them to its thread cache the next time it runs out of blocks.
+ * Queues are chained through the next link of the free list links, and are
+ * only ever emptied as a whole, so a push is a single compare and swap.
+ */
+typedef struct _heap_remote heap_remote;
+struct _heap_remote {
+	_Alignas(64) _Atomic(heap_block *) head;
+	bool claimed;
+};
+
+static heap_remote heap_remotes[HEAP_REMOTE_QUEUES];
+
+/*
+ * A slab is a heap block divided into objects of the same size. Free objects
+ * are tracked in a bitmap, with a set bit for every free object. The owner is
+ * the remote queue of the thread that last filled its cache from the slab.
+ */
+typedef struct _heap_slab heap_slab;
+struct _heap_slab {
+	pool_t *pool;
+	heap_remote *_Atomic owner;
+	heap_slab *previous;
+	heap_slab *next;
+	size_t free_count;
+	uint64_t free_map[];
+};
+
+/*
+ * A pool keeps the slabs that have free objects apart from the full ones.
+ * Objects of cached pools may be kept in the thread caches.
+ */
+struct _pool {
+	size_t size;
+	size_t stride;
+	size_t offset;
+	size_t capacity;
+	size_t slab_size;
+	bool cached;
+	heap_slab *partial;
+	heap_slab *full;
+};
+
+/*
+ * Small allocations are served from one pool per size class.
+ */
+static pool_t heap_pools[HEAP_SMALL_BINS];
+
+/*
+ * A directly mapped block starts with a record linking it to the other
+ * mapped blocks, followed by the tag of the block. Blocks with a larger
+ * alignment than HEAP_ALIGNMENT are placed further into the mapping, but
+ * always so that the record lies in its first page.
+ */
+typedef struct _heap_mapping heap_mapping;
+struct _heap_mapping {
+	heap_mapping *previous;
+	heap_mapping *next;
+	size_t size;
+	heap_block block;
+};
+
+static heap_mapping *heap_mappings;
+
+/*
+ * Cached blocks stay marked as used in the shared heap and are chained
+ * through the next link of their free list links.
+ */
+typedef struct _heap_tcache heap_tcache;
+struct _heap_tcache {
+	heap_block *blocks[HEAP_SMALL_BINS];
+	uint8_t count[HEAP_SMALL_BINS];
+	heap_remote *remote;
+};
+
+#ifdef HEAP_THREAD_CACHE
+#define HEAP_THREAD_LOCAL _Thread_local
+#else
+#define HEAP_THREAD_LOCAL
+#endif
+
+static HEAP_THREAD_LOCAL heap_tcache tcache;
+
+void *_map_pages(size_t size);
+void _unmap_pages(void *address, size_t size);
 
-static char heap_buffer[0x10000];
+/*
+ * The heap profiler samples one allocation every _profile_interval bytes,
+ * counted down separately by every thread. Its hooks cost a single load
+ * while it is stopped.
+ */
+extern atomic_size_t _profile_interval;
+extern atomic_size_t _profile_live_count;
+void _profile_sample(void *ptr, size_t size, void *frame);
+void _profile_forget(void *ptr);
+
+static HEAP_THREAD_LOCAL atomic_size_t profile_countdown;
+
+/*
+ * The tracer logs every call to the allocator while _trace_enabled is set.
+ */
+extern atomic_bool _trace_enabled;
+void _trace_record(int op, size_t size, void *ptr, void *old,
+		   size_t alignment);
+
+static void (*heap_error_handler)(const char *message, void *ptr);
+
+#ifdef HEAP_DEBUG
+/*
+ * In debug builds, the last word of every allocated block holds the size
+ * that was requested, mixed with a key computed from the header and the
+ * address of the block. The bytes between the requested size and that word
+ * are filled with HEAP_DEBUG_FILL, and freeing a block through the thread
+ * cache replaces the word with HEAP_DEBUG_FREED.
+ */
+#define HEAP_DEBUG_TAIL sizeof(size_t)
+#define HEAP_DEBUG_FILL 0xa5
+#define HEAP_DEBUG_FREED 0xdeadbeefdeadbeefull
+#define HEAP_DEBUG_KEY 0x9e3779b97f4a7c15ull
 
 /**
- * @brief Splits a heap block into two blocks.
+ * @brief Reports a heap error to the error handler.
  *
- * This function takes a pointer to the first block and a size, and splits the 
- * first block into two blocks. The first block will have the specified size, 
- * and the second block will contain the remaining space.
+ * Without a handler, or if the handler returns when the heap is unusable,
+ * the program is stopped.
  *
- * @param first Pointer to the first heap block to be split.
- * @param size The size of the first block after the split.
+ * @param message Description of the error.
+ * @param ptr The pointer the error was found at.
  */
-static void heap_split_block(heap_block *first, size_t size)
+static void heap_error(const char *message, void *ptr)
 {
-	heap_block *second =
-		(heap_block *)((uintptr_t)first + sizeof(heap_block) + size);
-	size_t second_size = first->size - size - sizeof(heap_block);
+	if (!heap_error_handler)
+		__builtin_trap();
+	heap_error_handler(message, ptr);
+}
+#else
+#define HEAP_DEBUG_TAIL 0
+#endif
 
-	second->used = false;
-	second->previous = first;
-	second->next = first->next;
-	second->size = second_size;
-	first->next = second;
-	first->size = size;
-	if (second->next)
-		second->next->previous = second;
+/*
+ * The first region of the heap is never released. Programs can place it with
+ * the linker symbols __heap_start and __heap_end, or size it with __heap_size,
+ * for example with -Wl,--defsym=__heap_size=0x100000. Otherwise the heap
+ * starts from a seed region that only holds the smallest possible block, and
+ * maps its memory from the kernel as it is needed. The heap is set up on its
+ * first use, so programs that never allocate do not touch it.
+ */
+#define HEAP_SEED_SIZE \
+	(HEAP_REGION_OFFSET + HEAP_MIN_SIZE + 2 * sizeof(heap_block))
+
+static _Alignas(HEAP_ALIGNMENT) char heap_seed[HEAP_SEED_SIZE];
+
+extern char __heap_start[] __attribute__((weak));
+extern char __heap_end[] __attribute__((weak));
+extern char __heap_size[] __attribute__((weak));
+
+static atomic_bool heap_ready;
 
-	if (last_block == first)
-		last_block = second;
+/**
+ * @brief Returns the size of the payload of a heap block.
+ *
+ * @param block Pointer to the heap block.
+ * @return The size of the block without its header.
+ */
+static size_t block_size(heap_block *block)
+{
+	return block->header & ~HEAP_FLAGS;
 }
 
 /**
- * @brief Merges two adjacent heap blocks into a single block.
+ * @brief Checks whether a block is an object in a slab.
  *
- * This function takes two adjacent heap blocks and merges them into a single
- * block. The first block should be the one that comes before the second block
- * in memory. After merging, the first block will encompass the memory of both
- * blocks, and the second block will no longer be valid.
+ * @param block Pointer to the header of the block or the tag of the object.
+ * @return true if the block is an object in a slab, false otherwise.
+ */
+static bool block_is_object(heap_block *block)
+{
+	return !(block->header & (HEAP_SIZE_BIT | HEAP_MAPPED));
+}
+
+/**
+ * @brief Checks whether a block is mapped directly from the kernel.
  *
- * @param first Pointer to the first heap block.
- * @param second Pointer to the second heap block.
+ * @param block Pointer to the header or the tag of the block.
+ * @return true if the block has its own mapping, false otherwise.
  */
-static void heap_merge_blocks(heap_block *first, heap_block *second)
+static bool block_is_mapped(heap_block *block)
 {
-	if (second->next)
-		second->next->previous = first;
-	first->next = second->next;
-	first->size += second->size + sizeof(heap_block);
+	return (block->header & (HEAP_SIZE_BIT | HEAP_MAPPED)) == HEAP_MAPPED;
+}
 
-	if (last_block == second)
-		last_block = first;
+/**
+ * @brief Returns the mapping record of a directly mapped block.
+ *
+ * @param block Pointer to the tag of the block.
+ * @return Pointer to the mapping record.
+ */
+static heap_mapping *block_mapping(heap_block *block)
+{
+	return (heap_mapping *)((uintptr_t)block -
+				offsetof(heap_mapping, block));
 }
 
 /**
- * @brief Expands the heap to accommodate more memory.
+ * @brief Returns the start of the mapping of a directly mapped block.
  *
- * This function attempts to increase the size of the heap to provide
- * additional memory for allocation. It does this by mapping a new page
- * of memory and adding it to the heap as a new block.
+ * @param mapping Pointer to the mapping record.
+ * @return The address of the first page of the mapping.
+ */
+static uintptr_t mapping_start(heap_mapping *mapping)
+{
+	return (uintptr_t)mapping & ~(uintptr_t)(HEAP_PAGE_SIZE - 1);
+}
+
+/**
+ * @brief Returns a node of the page map, mapping it if it is missing and
+ * should be created.
  *
- * @return true if the heap was successfully expanded, false otherwise.
+ * @param slot Pointer to where the parent node holds the node.
+ * @param size The size of the node.
+ * @param create Whether a missing node is mapped. The heap lock must be held
+ * if it is.
+ * @return Pointer to the node, or NULL if it is missing.
  */
-static bool expand_heap(void)
+static void *heap_pagemap_node(void *_Atomic *slot, size_t size, bool create)
 {
-	// TODO: Implement heap expansion logic
-	return false;
+	void *node = atomic_load_explicit(slot, memory_order_acquire);
+
+	if (!node && create && (node = _map_pages(size)))
+		atomic_store_explicit(slot, node, memory_order_release);
+	return node;
 }
 
 /**
- * @brief Initializes the heap.
- * 
- * This function initializes the heap by setting up the first block of memory
- * and marking it as free. It sets the start and end pointers of the heap
- * and initializes the first block.
+ * @brief Finds the word of the page map that holds the bit of a page.
+ *
+ * @param page The page number.
+ * @param create Whether missing nodes are mapped. The heap lock must be held
+ * if they are.
+ * @return Pointer to the word, or NULL if a node on the way is missing.
  */
-void heap_init(void)
+static _Atomic(uint64_t) *heap_pagemap_word(uintptr_t page, bool create)
 {
-	heap_start = (uintptr_t)heap_buffer;
-	heap_end = heap_start + sizeof(heap_buffer);
+	size_t root = page >> (HEAP_PAGEMAP_NODE_BITS + HEAP_PAGEMAP_LEAF_BITS);
+	size_t node = (page >> HEAP_PAGEMAP_LEAF_BITS) &
+		      ((1 << HEAP_PAGEMAP_NODE_BITS) - 1);
+	size_t leaf = page & ((1 << HEAP_PAGEMAP_LEAF_BITS) - 1);
+	void *_Atomic *nodes;
+	_Atomic(uint64_t) *words;
 
-	last_block = first_block = (heap_block *)heap_start;
-	first_block->size = sizeof(heap_buffer) - sizeof(heap_block);
-	first_block->previous = NULL;
-	first_block->next = NULL;
-	first_block->used = false;
+	if (page >= HEAP_PAGEMAP_PAGES)
+		return NULL;
+	nodes = heap_pagemap_node(&heap_pagemap,
+				  sizeof(void *) << HEAP_PAGEMAP_ROOT_BITS,
+				  create);
+	if (!nodes)
+		return NULL;
+	nodes = heap_pagemap_node(&nodes[root],
+				  sizeof(void *) << HEAP_PAGEMAP_NODE_BITS,
+				  create);
+	if (!nodes)
+		return NULL;
+	words = heap_pagemap_node(&nodes[node],
+				  (1 << HEAP_PAGEMAP_LEAF_BITS) / 8, create);
+	return words ? &words[leaf / 64] : NULL;
 }
 
 /**
- * @brief Allocates a block of memory on the heap. (helper function)
+ * @brief Marks whole pages as part of the heap or not. The heap lock must be
+ * held.
  *
- * This function allocates a block of memory of the specified size on the heap.
- * Returns NULL if the allocation fails. Use malloc() instead of this function to
- * allocate memory allowing the heap to expand if necessary.
+ * @param start The address of the first page.
+ * @param size The size of the pages in bytes.
+ * @param owned Whether the pages are part of the heap.
+ * @return true on success, false if a node of the page map cannot be mapped,
+ * in which case no page is marked.
+ */
+static bool heap_pagemap_set(uintptr_t start, size_t size, bool owned)
+{
+	uintptr_t page = start / HEAP_PAGE_SIZE;
+	uintptr_t end = (start + size) / HEAP_PAGE_SIZE;
+	_Atomic(uint64_t) *word;
+	uint64_t bits;
+	size_t count;
+
+	while (page < end) {
+		count = 64 - page % 64;
+		if (count > end - page)
+			count = end - page;
+		bits = (count == 64 ? ~0ull : (1ull << count) - 1) << page % 64;
+		if ((word = heap_pagemap_word(page, owned))) {
+			if (owned)
+				atomic_fetch_or_explicit(word, bits,
+							 memory_order_relaxed);
+			else
+				atomic_fetch_and_explicit(word, ~bits,
+							  memory_order_relaxed);
+		} else if (owned) {
+			heap_pagemap_set(start, page * HEAP_PAGE_SIZE - start,
+					 false);
+			return false;
+		}
+		page += count;
+	}
+	return true;
+}
+
+/**
+ * @brief Checks whether a pointer may have been returned by the allocator.
  *
- * @param size The size of the memory block to allocate.
- * @return A pointer to the allocated memory block, or NULL if the allocation fails.
+ * @param ptr The pointer to check.
+ * @return true if the tag in front of ptr lies in the first region of the
+ * heap or in a page of the page map, false otherwise.
  */
-static heap_block *do_malloc(size_t size)
+static bool heap_contains(void *ptr)
 {
-	heap_block *i = first_block;
-	while (i) {
-		if (!i->used && i->size >= size) {
-			if (i->size > size + 2 * sizeof(heap_block))
-				heap_split_block(i, size);
-			i->used = true;
-			return i;
+	uintptr_t tag = (uintptr_t)ptr - sizeof(heap_block);
+	uintptr_t page = tag / HEAP_PAGE_SIZE;
+	_Atomic(uint64_t) *word;
+
+	if (tag >= heap_first_start && tag < heap_first_end)
+		return true;
+	if (!(word = heap_pagemap_word(page, false)))
+		return false;
+	return atomic_load_explicit(word, memory_order_relaxed) >> page % 64 &
+	       1;
+}
+
+/**
+ * @brief Returns the slab that holds an object.
+ *
+ * @param object Pointer to the tag of the object.
+ * @return Pointer to the slab of the object.
+ */
+static heap_slab *object_slab(heap_block *object)
+{
+	heap_block *block = (heap_block *)((uintptr_t)object -
+					   (object->header & ~HEAP_FLAGS));
+	return (heap_slab *)((uintptr_t)block + sizeof(heap_block));
+}
+
+/**
+ * @brief Returns the number of bytes that can be used in an allocated block.
+ *
+ * This includes any slack left when the block was not split, so it can be
+ * larger than the size that was requested.
+ *
+ * @param block Pointer to the block, object or mapped block.
+ * @return The usable size of the block.
+ */
+static size_t block_usable_size(heap_block *block)
+{
+	if (block_is_mapped(block))
+		return mapping_start(block_mapping(block)) +
+		       block_mapping(block)->size - (uintptr_t)block -
+		       sizeof(heap_block);
+	if (block_is_object(block))
+		return object_slab(block)->pool->size;
+	return block_size(block);
+}
+
+/**
+ * @brief Returns the heap block that follows a block in memory.
+ *
+ * @param block Pointer to the heap block.
+ * @return Pointer to the next heap block.
+ */
+static heap_block *block_next(heap_block *block)
+{
+	return (heap_block *)((uintptr_t)block + sizeof(heap_block) +
+			      block_size(block));
+}
+
+/**
+ * @brief Returns the heap block that precedes a block in memory.
+ *
+ * The previous block is found through its footer, so this is only valid if
+ * the previous block is free.
+ *
+ * @param block Pointer to the heap block.
+ * @return Pointer to the previous heap block.
+ */
+static heap_block *block_previous(heap_block *block)
+{
+	size_t size = *(size_t *)((uintptr_t)block - sizeof(size_t));
+	return (heap_block *)((uintptr_t)block - size - sizeof(heap_block));
+}
+
+/**
+ * @brief Returns the index of the size class bin for a block size.
+ *
+ * @param size The size of the block, which must be below HEAP_SMALL_LIMIT
+ * unless HEAP_TLSF is defined.
+ * @return The index of the bin holding free blocks of that size.
+ */
+static size_t heap_bin_index(size_t size)
+{
+#ifdef HEAP_TLSF
+	size_t level;
+
+	if (size < HEAP_SMALL_LIMIT)
+		return size / HEAP_ALIGNMENT;
+	level = (63 - __builtin_clzl(size)) -
+		(63 - __builtin_clzl(HEAP_SMALL_LIMIT));
+	return HEAP_SMALL_BINS + level * HEAP_TLSF_SUBBINS +
+	       ((size >> (63 - __builtin_clzl(size) - HEAP_TLSF_SHIFT)) &
+		(HEAP_TLSF_SUBBINS - 1));
+#else
+	return size / HEAP_ALIGNMENT;
+#endif
+}
+
+#ifndef HEAP_TLSF
+/**
+ * @brief Compares two free blocks by size, then by address.
+ *
+ * @param a Pointer to the first block.
+ * @param b Pointer to the second block.
+ * @return True if a comes before b in the tree, false otherwise.
+ */
+static bool heap_tree_less(heap_block *a, heap_block *b)
+{
+	return block_size(a) < block_size(b) ||
+	       (block_size(a) == block_size(b) && a < b);
+}
+
+/**
+ * @brief Checks whether a node of the tree is red.
+ *
+ * @param block Pointer to the block, or NULL for an empty leaf.
+ * @return True if the block is a red node, false otherwise.
+ */
+static bool heap_tree_red(heap_block *block)
+{
+	return block && TREE_LINKS(block)->red;
+}
+
+/**
+ * @brief Replaces a node of the tree in the link from its parent.
+ *
+ * @param old Pointer to the node to replace.
+ * @param new Pointer to the replacement, or NULL.
+ */
+static void heap_tree_replace(heap_block *old, heap_block *new)
+{
+	heap_block *parent = TREE_LINKS(old)->parent;
+
+	if (!parent)
+		heap_tree = new;
+	else if (TREE_LINKS(parent)->left == old)
+		TREE_LINKS(parent)->left = new;
+	else
+		TREE_LINKS(parent)->right = new;
+	if (new)
+		TREE_LINKS(new)->parent = parent;
+}
+
+/**
+ * @brief Rotates a node of the tree down to the left or to the right.
+ *
+ * @param block Pointer to the node to rotate.
+ * @param left True to move the node to the left of its right child, false
+ * to move it to the right of its left child.
+ */
+static void heap_tree_rotate(heap_block *block, bool left)
+{
+	heap_tree_links *links = TREE_LINKS(block);
+	heap_block *child = left ? links->right : links->left;
+	heap_tree_links *child_links = TREE_LINKS(child);
+	heap_block *inner = left ? child_links->left : child_links->right;
+
+	heap_tree_replace(block, child);
+	if (left) {
+		links->right = inner;
+		child_links->left = block;
+	} else {
+		links->left = inner;
+		child_links->right = block;
+	}
+	if (inner)
+		TREE_LINKS(inner)->parent = block;
+	links->parent = child;
+}
+
+/**
+ * @brief Inserts a free block into the tree.
+ *
+ * @param block Pointer to the block.
+ */
+static void heap_tree_insert(heap_block *block)
+{
+	heap_block *parent = NULL;
+	heap_block **link = &heap_tree;
+	heap_block *grandparent;
+	heap_block *uncle;
+	bool left;
+
+	while (*link) {
+		parent = *link;
+		if (heap_tree_less(block, parent))
+			link = &TREE_LINKS(parent)->left;
+		else
+			link = &TREE_LINKS(parent)->right;
+	}
+	*link = block;
+	*TREE_LINKS(block) = (heap_tree_links){ .parent = parent, .red = true };
+
+	while (heap_tree_red(parent = TREE_LINKS(block)->parent)) {
+		grandparent = TREE_LINKS(parent)->parent;
+		left = parent == TREE_LINKS(grandparent)->left;
+		uncle = left ? TREE_LINKS(grandparent)->right :
+			       TREE_LINKS(grandparent)->left;
+		if (heap_tree_red(uncle)) {
+			TREE_LINKS(parent)->red = false;
+			TREE_LINKS(uncle)->red = false;
+			TREE_LINKS(grandparent)->red = true;
+			block = grandparent;
+			continue;
 		}
-		i = i->next;
+		if (block == (left ? TREE_LINKS(parent)->right :
+				     TREE_LINKS(parent)->left)) {
+			heap_tree_rotate(parent, left);
+			block = parent;
+			parent = TREE_LINKS(block)->parent;
+		}
+		TREE_LINKS(parent)->red = false;
+		TREE_LINKS(grandparent)->red = true;
+		heap_tree_rotate(grandparent, !left);
 	}
-	return NULL;
+	TREE_LINKS(heap_tree)->red = false;
 }
 
 /**
- * @brief Allocates a block of memory on the heap.
+ * @brief Restores the balance of the tree after a black node was removed.
  *
- * This function allocates a block of memory of the specified size on the heap.
- * If the allocation fails, it attempts to expand the heap to accommodate the
- * requested memory size.
+ * @param block Pointer to the node that took the place of the removed
+ * node, or NULL.
+ * @param parent Pointer to the parent of that node.
+ */
+static void heap_tree_rebalance(heap_block *block, heap_block *parent)
+{
+	heap_block *sibling;
+	bool left;
+
+	while (block != heap_tree && !heap_tree_red(block)) {
+		left = block == TREE_LINKS(parent)->left;
+		sibling = left ? TREE_LINKS(parent)->right :
+				 TREE_LINKS(parent)->left;
+		if (heap_tree_red(sibling)) {
+			TREE_LINKS(sibling)->red = false;
+			TREE_LINKS(parent)->red = true;
+			heap_tree_rotate(parent, left);
+			sibling = left ? TREE_LINKS(parent)->right :
+					 TREE_LINKS(parent)->left;
+		}
+		if (!heap_tree_red(TREE_LINKS(sibling)->left) &&
+		    !heap_tree_red(TREE_LINKS(sibling)->right)) {
+			TREE_LINKS(sibling)->red = true;
+			block = parent;
+			parent = TREE_LINKS(block)->parent;
+			continue;
+		}
+		if (!heap_tree_red(left ? TREE_LINKS(sibling)->right :
+					  TREE_LINKS(sibling)->left)) {
+			TREE_LINKS(left ? TREE_LINKS(sibling)->left :
+					  TREE_LINKS(sibling)->right)
+				->red = false;
+			TREE_LINKS(sibling)->red = true;
+			heap_tree_rotate(sibling, !left);
+			sibling = left ? TREE_LINKS(parent)->right :
+					 TREE_LINKS(parent)->left;
+		}
+		TREE_LINKS(sibling)->red = TREE_LINKS(parent)->red;
+		TREE_LINKS(parent)->red = false;
+		TREE_LINKS(left ? TREE_LINKS(sibling)->right :
+				  TREE_LINKS(sibling)->left)
+			->red = false;
+		heap_tree_rotate(parent, left);
+		block = heap_tree;
+	}
+	if (block)
+		TREE_LINKS(block)->red = false;
+}
+
+/**
+ * @brief Removes a free block from the tree.
  *
- * @param size The size of the memory block to allocate.
- * @return A pointer to the allocated memory block, or NULL if the allocation fails.
+ * @param block Pointer to the block.
  */
-void *malloc(size_t size)
+static void heap_tree_remove(heap_block *block)
 {
-	heap_block *i = NULL;
-	while (true) {
-		if ((i = do_malloc(size)))
-			return (uint8_t *)i + sizeof(heap_block);
-		if (!expand_heap())
-			return NULL;
+	heap_tree_links *links = TREE_LINKS(block);
+	heap_block *successor;
+	heap_block *child;
+	heap_block *parent;
+	bool red = links->red;
+
+	if (!links->left || !links->right) {
+		child = links->left ? links->left : links->right;
+		parent = links->parent;
+		heap_tree_replace(block, child);
+	} else {
+		successor = links->right;
+		while (TREE_LINKS(successor)->left)
+			successor = TREE_LINKS(successor)->left;
+		red = TREE_LINKS(successor)->red;
+		child = TREE_LINKS(successor)->right;
+		parent = successor;
+		if (TREE_LINKS(successor)->parent != block) {
+			parent = TREE_LINKS(successor)->parent;
+			heap_tree_replace(successor, child);
+			TREE_LINKS(successor)->right = links->right;
+			TREE_LINKS(links->right)->parent = successor;
+		}
+		heap_tree_replace(block, successor);
+		TREE_LINKS(successor)->left = links->left;
+		TREE_LINKS(links->left)->parent = successor;
+		TREE_LINKS(successor)->red = links->red;
 	}
+
+	if (!red)
+		heap_tree_rebalance(child, parent);
 }
+#endif
 
 /**
- * @brief Frees the memory space pointed to by ptr, which must have been returned by a previous call to malloc().
+ * @brief Adds a free block to the bin of its size class.
  *
- * @param ptr Pointer to the memory to be freed.
+ * This also writes the footer of the block.
+ *
+ * @param block Pointer to the free heap block.
  */
-void free(void *ptr)
+static void heap_link_free(heap_block *block)
 {
-	heap_block *i = (heap_block *)((uintptr_t)ptr - sizeof(heap_block));
-	if ((uintptr_t)i < heap_start || (uintptr_t)i >= heap_end)
+	size_t bin;
+	heap_free_links *links = FREE_LINKS(block);
+
+	*(size_t *)((uintptr_t)block_next(block) - sizeof(size_t)) =
+		block_size(block);
+	heap_totals.free_size += block_size(block);
+	heap_totals.free_count++;
+
+#ifndef HEAP_TLSF
+	if (block_size(block) >= HEAP_SMALL_LIMIT) {
+		heap_tree_insert(block);
 		return;
-	i->used = false;
+	}
+#endif
+	bin = heap_bin_index(block_size(block));
+	links->previous = NULL;
+	links->next = heap_bins[bin];
+	if (links->next)
+		FREE_LINKS(links->next)->previous = block;
+	heap_bins[bin] = block;
+	heap_bin_map[bin / 64] |= 1ull << (bin % 64);
+#ifdef HEAP_TLSF
+	heap_bin_summary |= 1ull << (bin / 64);
+#endif
+}
 
-	if (i->next && !i->next->used)
-		heap_merge_blocks(i, i->next);
-	if (i->previous && !i->previous->used)
-		heap_merge_blocks(i->previous, i);
+/**
+ * @brief Removes a free block from the bin of its size class.
+ *
+ * @param block Pointer to the free heap block.
+ */
+static void heap_unlink_free(heap_block *block)
+{
+	size_t bin;
+	heap_free_links *links = FREE_LINKS(block);
+
+	heap_totals.free_size -= block_size(block);
+	heap_totals.free_count--;
+
+#ifndef HEAP_TLSF
+	if (block_size(block) >= HEAP_SMALL_LIMIT) {
+		heap_tree_remove(block);
+		return;
+	}
+#endif
+	bin = heap_bin_index(block_size(block));
+#ifdef HEAP_DEBUG
+	if ((links->previous ? FREE_LINKS(links->previous)->next :
+			       heap_bins[bin]) != block ||
+	    (links->next && FREE_LINKS(links->next)->previous != block)) {
+		heap_error("corrupted free list", block);
+		__builtin_trap();
+	}
+#endif
+	if (links->previous)
+		FREE_LINKS(links->previous)->next = links->next;
+	else
+		heap_bins[bin] = links->next;
+	if (links->next)
+		FREE_LINKS(links->next)->previous = links->previous;
+
+	if (!heap_bins[bin])
+		heap_bin_map[bin / 64] &= ~(1ull << (bin % 64));
+#ifdef HEAP_TLSF
+	if (!heap_bin_map[bin / 64])
+		heap_bin_summary &= ~(1ull << (bin / 64));
+#endif
+}
+
+#ifdef HEAP_TLSF
+/**
+ * @brief Finds a free block large enough for the requested size.
+ *
+ * Large requests are rounded up to the next bin, so the head of the first
+ * non-empty bin found in the bitmaps always fits and no list is searched.
+ *
+ * @param size The requested size.
+ * @return A pointer to a fitting free block, or NULL if there is none.
+ */
+static heap_block *heap_find_free(size_t size)
+{
+	size_t step;
+	size_t bin;
+	size_t word;
+	uint64_t map;
+
+	if (size >= HEAP_SMALL_LIMIT) {
+		step = (size_t)1 << (63 - __builtin_clzl(size) -
+				     HEAP_TLSF_SHIFT);
+		size += step - 1;
+	}
+	bin = heap_bin_index(size);
+	word = bin / 64;
+
+	map = heap_bin_map[word] & (~0ull << (bin % 64));
+	if (!map) {
+		map = heap_bin_summary & (~1ull << word);
+		if (!map)
+			return NULL;
+		word = __builtin_ctzll(map);
+		map = heap_bin_map[word];
+	}
+	return heap_bins[word * 64 + __builtin_ctzll(map)];
+}
+#else
+/**
+ * @brief Finds the best fitting free block for the requested size.
+ *
+ * Small bins hold blocks of exactly one size, so the head of the first
+ * non-empty small bin at or above the requested class fits best. Otherwise
+ * the smallest large block that fits is looked up in the tree, the one at
+ * the lowest address if several have the same size.
+ *
+ * @param size The requested size.
+ * @return A pointer to a fitting free block, or NULL if there is none.
+ */
+static heap_block *heap_find_free(size_t size)
+{
+	heap_block *best = NULL;
+	uint64_t map;
+
+	if (size < HEAP_SMALL_LIMIT) {
+		map = heap_bin_map[0] & (~0ull << heap_bin_index(size));
+		if (map)
+			return heap_bins[__builtin_ctzll(map)];
+	}
+
+	for (heap_block *i = heap_tree; i;) {
+		if (block_size(i) >= size) {
+			best = i;
+			i = TREE_LINKS(i)->left;
+		} else {
+			i = TREE_LINKS(i)->right;
+		}
+	}
+	return best;
+}
+#endif
+
+/**
+ * @brief Finds the size of the largest free block.
+ *
+ * Only the highest non-empty bin is searched, which holds a handful of
+ * blocks at most in practice. Without TLSF, large blocks are in the tree
+ * and the largest one is its rightmost node.
+ *
+ * @return The size of the largest free block, or 0 if there is none.
+ */
+static size_t heap_largest_free(void)
+{
+	size_t largest = 0;
+	size_t bin;
+
+#ifndef HEAP_TLSF
+	heap_block *block = heap_tree;
+
+	if (block) {
+		while (TREE_LINKS(block)->right)
+			block = TREE_LINKS(block)->right;
+		return block_size(block);
+	}
+#endif
+	for (size_t word = HEAP_BIN_WORDS; word-- > 0;) {
+		if (!heap_bin_map[word])
+			continue;
+		bin = word * 64 + 63 - __builtin_clzll(heap_bin_map[word]);
+		for (heap_block *i = heap_bins[bin]; i; i = FREE_LINKS(i)->next)
+			if (block_size(i) > largest)
+				largest = block_size(i);
+		break;
+	}
+	return largest;
+}
+
+/**
+ * @brief Acquires the lock protecting the shared heap.
+ */
+static void heap_acquire(void)
+{
+	while (atomic_flag_test_and_set_explicit(&heap_lock,
+						 memory_order_acquire))
+		;
+}
+
+/**
+ * @brief Releases the lock protecting the shared heap.
+ */
+static void heap_release(void)
+{
+	atomic_flag_clear_explicit(&heap_lock, memory_order_release);
+}
+
+#ifdef HEAP_THREAD_CACHE
+#define tcache_acquire() ((void)0)
+#define tcache_release() ((void)0)
+#define tcache_lock_heap() heap_acquire()
+#define tcache_unlock_heap() heap_release()
+#else
+/*
+ * The shared thread cache is used with the heap lock held, so the thread
+ * cache functions that reach into the shared heap find it locked already.
+ */
+#define tcache_acquire() heap_acquire()
+#define tcache_release() heap_release()
+#define tcache_lock_heap() ((void)0)
+#define tcache_unlock_heap() ((void)0)
+#endif
+
+/**
+ * @brief Records the current memory usage if it is the highest so far. The
+ * heap lock must be held.
+ */
+static void heap_note_usage(void)
+{
+	size_t usage = heap_totals.region_size - heap_totals.free_size -
+		       heap_totals.fast_size + heap_totals.mapped_size;
+
+	if (usage > heap_totals.peak)
+		heap_totals.peak = usage;
+}
+
+/**
+ * @brief Splits a heap block into two blocks.
+ *
+ * This function takes a pointer to the first block and a size, and splits the 
+ * first block into two blocks. The first block will have the specified size, 
+ * and the second block will contain the remaining space. The second block is
+ * free, but it is not added to the free lists.
+ *
+ * @param first Pointer to the first heap block to be split.
+ * @param size The size of the first block after the split.
+ */
+static void heap_split_block(heap_block *first, size_t size)
+{
+	heap_block *second =
+		(heap_block *)((uintptr_t)first + sizeof(heap_block) + size);
+	size_t second_size = block_size(first) - size - sizeof(heap_block);
+
+	second->header = second_size | (first->header & HEAP_CLEAN);
+	if (first->header & HEAP_USED)
+		second->header |= HEAP_PREVIOUS_USED;
+	block_next(second)->header &= ~HEAP_PREVIOUS_USED;
+	first->header = size | (first->header & HEAP_FLAGS);
+}
+
+/**
+ * @brief Merges two adjacent heap blocks into a single block.
+ *
+ * This function takes two adjacent heap blocks and merges them into a single
+ * block. The first block should be the one that comes before the second block
+ * in memory. After merging, the first block will encompass the memory of both
+ * blocks, and the second block will no longer be valid. The merged block is
+ * clean if both blocks were, in which case the header of the second block and
+ * the metadata around it are cleared.
+ *
+ * @param first Pointer to the first heap block.
+ * @param second Pointer to the second heap block.
+ */
+static void heap_merge_blocks(heap_block *first, heap_block *second)
+{
+	size_t size = block_size(second) + sizeof(heap_block);
+	size_t metadata = block_size(second) < HEAP_FREE_METADATA ?
+				  block_size(second) :
+				  HEAP_FREE_METADATA;
+
+	if (first->header & second->header & HEAP_CLEAN)
+		memset((void *)((uintptr_t)second - sizeof(size_t)), 0,
+		       sizeof(size_t) + sizeof(heap_block) + metadata);
+	else
+		first->header &= ~HEAP_CLEAN;
+	first->header += size;
+}
+
+/**
+ * @brief Returns a block to the shared heap.
+ *
+ * This function marks the block as free, merges it with its free neighbours
+ * and adds the result to the free lists. The neighbours are found through the
+ * block header and the footer of the previous block, so this takes constant
+ * time. The heap lock must be held.
+ *
+ * @param i Pointer to the heap block to free.
+ * @return A pointer to the free block the heap block was merged into.
+ */
+static heap_block *do_free(heap_block *i)
+{
+	heap_block *next = block_next(i);
+
+	i->header &= ~HEAP_USED;
+	next->header &= ~HEAP_PREVIOUS_USED;
+
+	if (!(next->header & HEAP_USED)) {
+		heap_unlink_free(next);
+		heap_merge_blocks(i, next);
+	}
+	if (!(i->header & HEAP_PREVIOUS_USED)) {
+		next = i;
+		i = block_previous(i);
+		heap_unlink_free(i);
+		heap_merge_blocks(i, next);
+	}
+	heap_link_free(i);
+	return i;
+}
+
+/**
+ * @brief Shrinks a used heap block to the specified size.
+ *
+ * If the space beyond size is large enough to form a block of its own, it is
+ * split off and returned to the heap, merging with the next block if that
+ * one is free. Otherwise the block is left unchanged.
+ *
+ * @param i Pointer to the used heap block.
+ * @param size The new size of the block.
+ */
+static void heap_shrink_block(heap_block *i, size_t size)
+{
+	if (block_size(i) < size + sizeof(heap_block) + HEAP_MIN_SIZE)
+		return;
+	heap_split_block(i, size);
+	do_free(block_next(i));
+}
+
+/**
+ * @brief Grows a used heap block in place to at least the specified size.
+ *
+ * This function absorbs the next block if it is free and large enough, and
+ * returns any excess space to the heap.
+ *
+ * @param i Pointer to the used heap block.
+ * @param size The new size of the block.
+ * @return true if the block now holds at least size bytes, false otherwise.
+ */
+static bool heap_grow_block(heap_block *i, size_t size)
+{
+	heap_block *next = block_next(i);
+
+	if (block_size(i) >= size)
+		return true;
+	if (next->header & HEAP_USED ||
+	    block_size(i) + sizeof(heap_block) + block_size(next) < size)
+		return false;
+
+	heap_unlink_free(next);
+	heap_merge_blocks(i, next);
+	block_next(i)->header |= HEAP_PREVIOUS_USED;
+	heap_shrink_block(i, size);
+	heap_note_usage();
+	return true;
+}
+
+/**
+ * @brief Expands the heap to accommodate more memory.
+ *
+ * This function attempts to increase the size of the heap to provide
+ * additional memory for allocation. It maps a new region of pages from the
+ * kernel, large enough for the requested size, and adds it to the heap as a
+ * new free block. If the region directly follows the end of the heap, the
+ * block at the end is extended instead.
+ *
+ * @param size The size of the allocation that needs to fit in the new region.
+ * @return true if the heap was successfully expanded, false otherwise.
+ */
+static bool expand_heap(size_t size)
+{
+	size_t chunk = heap_chunk_size;
+	heap_block *block;
+	uintptr_t region;
+
+	if (size > SIZE_MAX / 4)
+		return false;
+	while (chunk < size + HEAP_REGION_OFFSET + 2 * sizeof(heap_block))
+		chunk *= 2;
+	chunk = (chunk + HEAP_PAGE_SIZE - 1) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1);
+
+	region = (uintptr_t)_map_pages(chunk);
+	if (!region)
+		return false;
+	if (!heap_pagemap_set(region, chunk, true)) {
+		_unmap_pages((void *)region, chunk);
+		return false;
+	}
+	if (heap_chunk_size < HEAP_MAX_CHUNK)
+		heap_chunk_size *= 2;
+	heap_totals.region_size += chunk;
+	heap_totals.expansions++;
+
+	if (region < heap_start)
+		heap_start = region;
+	if (region + chunk > heap_end)
+		heap_end = region + chunk;
+
+	if (region == (uintptr_t)heap_tail + sizeof(heap_block)) {
+		heap_regions->size += chunk;
+		block = heap_tail;
+		block->header = (block->header & HEAP_PREVIOUS_USED) |
+				(chunk - sizeof(heap_block)) | HEAP_CLEAN |
+				HEAP_USED;
+	} else {
+		((heap_region *)region)->previous = heap_regions;
+		((heap_region *)region)->size = chunk;
+		heap_regions = (heap_region *)region;
+		block = (heap_block *)(region + HEAP_REGION_OFFSET);
+		block->header = (chunk - HEAP_REGION_OFFSET -
+				 2 * sizeof(heap_block)) |
+				HEAP_CLEAN | HEAP_PREVIOUS_USED | HEAP_USED;
+	}
+	heap_tail = block_next(block);
+	heap_tail->header = HEAP_PREVIOUS_USED | HEAP_USED;
+
+	do_free(block);
+	return true;
+}
+
+/**
+ * @brief Returns free memory at the end of the heap to the kernel.
+ *
+ * Regions that are free as a whole are unmapped as long as pad bytes stay
+ * free at the end of the region before them. Then the whole pages after the
+ * first pad bytes of the free block at the end of the heap are unmapped. The
+ * first region of the heap is never released. The heap lock must be held.
+ *
+ * @param pad Number of free bytes to keep at the end of the heap.
+ * @return True if any memory was released, false otherwise.
+ */
+static bool heap_trim(size_t pad)
+{
+	heap_region *region = heap_regions;
+	heap_block *top;
+	heap_block *tail;
+	uintptr_t end;
+	uintptr_t keep;
+	bool trimmed = false;
+
+	while (region->previous &&
+	       !(heap_tail->header & HEAP_PREVIOUS_USED)) {
+		top = block_previous(heap_tail);
+		end = (uintptr_t)region + region->size;
+
+		tail = (heap_block *)((uintptr_t)region->previous +
+				      region->previous->size -
+				      sizeof(heap_block));
+		if ((uintptr_t)top == (uintptr_t)region + HEAP_REGION_OFFSET &&
+		    (!pad || (!(tail->header & HEAP_PREVIOUS_USED) &&
+			      block_size(block_previous(tail)) >= pad))) {
+			heap_unlink_free(top);
+			heap_regions = region->previous;
+			heap_tail = tail;
+			heap_totals.region_size -= region->size;
+			heap_pagemap_set((uintptr_t)region, region->size,
+					 false);
+			_unmap_pages(region, region->size);
+			region = heap_regions;
+			trimmed = true;
+			continue;
+		}
+
+		if (pad >= end - (uintptr_t)top)
+			break;
+		keep = (uintptr_t)top + HEAP_MIN_SIZE + pad +
+		       2 * sizeof(heap_block);
+		keep = (keep + HEAP_PAGE_SIZE - 1) &
+		       ~(uintptr_t)(HEAP_PAGE_SIZE - 1);
+		if (keep >= end)
+			break;
+
+		heap_unlink_free(top);
+		top->header = (keep - (uintptr_t)top - 2 * sizeof(heap_block)) |
+			      (top->header & HEAP_FLAGS);
+		heap_tail = block_next(top);
+		heap_tail->header = HEAP_USED;
+		heap_link_free(top);
+		region->size = keep - (uintptr_t)region;
+		heap_totals.region_size -= end - keep;
+		heap_pagemap_set(keep, end - keep, false);
+		if (keep < heap_first_end)
+			heap_first_end = keep;
+		_unmap_pages((void *)keep, end - keep);
+		trimmed = true;
+		break;
+	}
+	return trimmed;
+}
+
+#ifndef HEAP_TLSF
+/**
+ * @brief Trims the heap if the free block at its end exceeds the trim
+ * threshold, looking past regions that are free as a whole. The heap lock
+ * must be held.
+ */
+static void heap_auto_trim(void)
+{
+	heap_region *region = heap_regions;
+	heap_block *tail = heap_tail;
+	heap_block *top;
+
+	while (!(tail->header & HEAP_PREVIOUS_USED)) {
+		top = block_previous(tail);
+		if (block_size(top) >= heap_trim_threshold) {
+			heap_trim(heap_top_pad);
+			return;
+		}
+		if (!region->previous ||
+		    (uintptr_t)top != (uintptr_t)region + HEAP_REGION_OFFSET)
+			return;
+		region = region->previous;
+		tail = (heap_block *)((uintptr_t)region + region->size -
+				      sizeof(heap_block));
+	}
+}
+#else
+#define heap_auto_trim() ((void)0)
+#endif
+
+/**
+ * @brief Allocates a block in a mapping of its own.
+ *
+ * The block starts as far into the first page as its alignment requires.
+ * For alignments larger than a page, the mapping is made larger by the
+ * difference, and the pages before and after the block are unmapped again.
+ *
+ * @param size The size of the memory block to allocate.
+ * @param alignment The alignment of the block, a power of two.
+ * @return A pointer to the tag of the block, or NULL if the mapping fails.
+ */
+static heap_block *heap_map(size_t size, size_t alignment)
+{
+	size_t offset = sizeof(heap_mapping);
+	size_t extra = 0;
+	size_t length;
+	uintptr_t base;
+	uintptr_t start;
+	heap_mapping *mapping;
+
+	if (alignment > HEAP_PAGE_SIZE) {
+		offset = HEAP_PAGE_SIZE;
+		extra = alignment - HEAP_PAGE_SIZE;
+	} else if (alignment > offset) {
+		offset = alignment;
+	}
+	length = (size + offset + HEAP_PAGE_SIZE - 1) &
+		 ~(size_t)(HEAP_PAGE_SIZE - 1);
+	if (!(base = (uintptr_t)_map_pages(length + extra)))
+		return NULL;
+
+	start = base;
+	if (extra) {
+		start = ((base + offset + alignment - 1) & ~(alignment - 1)) -
+			offset;
+		if (start != base)
+			_unmap_pages((void *)base, start - base);
+		if (start != base + extra)
+			_unmap_pages((void *)(start + length),
+				     base + extra - start);
+	}
+	mapping = (heap_mapping *)(start + offset - sizeof(heap_mapping));
+	mapping->size = length;
+	mapping->block.header = HEAP_MAPPED | HEAP_USED;
+
+	heap_acquire();
+	if (!heap_pagemap_set(start, length, true)) {
+		heap_release();
+		_unmap_pages((void *)start, length);
+		return NULL;
+	}
+	mapping->previous = NULL;
+	mapping->next = heap_mappings;
+	if (mapping->next)
+		mapping->next->previous = mapping;
+	heap_mappings = mapping;
+	heap_totals.mapped_size += length;
+	heap_totals.mapped_count++;
+	heap_note_usage();
+	heap_release();
+	return &mapping->block;
+}
+
+/**
+ * @brief Returns the mapping of a directly mapped block to the kernel.
+ *
+ * @param block Pointer to the tag of the block.
+ */
+static void heap_unmap(heap_block *block)
+{
+	heap_mapping *mapping = block_mapping(block);
+
+	heap_acquire();
+	if (mapping->previous)
+		mapping->previous->next = mapping->next;
+	else
+		heap_mappings = mapping->next;
+	if (mapping->next)
+		mapping->next->previous = mapping->previous;
+	heap_totals.mapped_size -= mapping->size;
+	heap_totals.mapped_count--;
+	heap_pagemap_set(mapping_start(mapping), mapping->size, false);
+	heap_release();
+
+	_unmap_pages((void *)mapping_start(mapping), mapping->size);
+}
+
+/**
+ * @brief Rounds a requested allocation size up to a valid block size.
+ *
+ * @param size The requested size.
+ * @return The size of the block to allocate, or 0 if the request is too large.
+ */
+static size_t heap_request_size(size_t size)
+{
+	if (size > SIZE_MAX / 2)
+		return 0;
+	size = (size + HEAP_DEBUG_TAIL + sizeof(heap_block) +
+		HEAP_ALIGNMENT - 1) &
+	       ~(HEAP_ALIGNMENT - 1);
+	size -= sizeof(heap_block);
+	if (size < HEAP_MIN_SIZE)
+		size = HEAP_MIN_SIZE;
+	return size;
+}
+
+/**
+ * @brief Allocates a block of memory on the heap. (helper function)
+ *
+ * This function allocates a block of memory of the specified size on the heap.
+ * Returns NULL if the allocation fails. Use malloc() instead of this function to
+ * allocate memory allowing the heap to expand if necessary.
+ *
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL if the allocation fails.
+ */
+static heap_block *do_malloc(size_t size)
+{
+	heap_block *i = heap_find_free(size);
+	if (!i)
+		return NULL;
+
+	heap_unlink_free(i);
+	i->header |= HEAP_USED;
+	block_next(i)->header |= HEAP_PREVIOUS_USED;
+	heap_shrink_block(i, size);
+	heap_note_usage();
+	return i;
+}
+
+#ifndef HEAP_TLSF
+/**
+ * @brief Returns the index of the fast bin for a block size.
+ *
+ * @param size The size of the block, from HEAP_SMALL_LIMIT up to
+ * HEAP_FAST_LIMIT.
+ * @return The index of the fast bin.
+ */
+static size_t heap_fast_index(size_t size)
+{
+	return (size - HEAP_SMALL_LIMIT) / HEAP_ALIGNMENT;
+}
+
+/**
+ * @brief Keeps a freed block in its fast bin if it is of a fast bin size,
+ * the fast bins are not full and it would not merge into a large free block.
+ * The heap lock must be held.
+ *
+ * @param block Pointer to the block, still marked as used.
+ * @return True if the block was added to a fast bin, false otherwise.
+ */
+static bool heap_fast_push(heap_block *block)
+{
+	size_t size = block_size(block);
+	size_t merged = size;
+	heap_block *next = block_next(block);
+	size_t bin;
+
+	if (size < HEAP_SMALL_LIMIT || size >= HEAP_FAST_LIMIT ||
+	    heap_totals.fast_size + size > HEAP_FAST_MAX)
+		return false;
+	if (!(next->header & HEAP_USED))
+		merged += block_size(next) + sizeof(heap_block);
+	if (!(block->header & HEAP_PREVIOUS_USED))
+		merged += block_size(block_previous(block)) +
+			  sizeof(heap_block);
+	if (merged >= HEAP_FAST_CONSOLIDATE)
+		return false;
+	bin = heap_fast_index(size);
+	FREE_LINKS(block)->next = heap_fast_bins[bin];
+	heap_fast_bins[bin] = block;
+	heap_totals.fast_size += size;
+	heap_totals.fast_count++;
+	return true;
+}
+
+/**
+ * @brief Takes a block of exactly the requested size from its fast bin.
+ * The heap lock must be held.
+ *
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the block, or NULL if the fast bin is empty.
+ */
+static heap_block *heap_fast_pop(size_t size)
+{
+	heap_block *block;
+	size_t bin;
+
+	if (size < HEAP_SMALL_LIMIT || size >= HEAP_FAST_LIMIT)
+		return NULL;
+	bin = heap_fast_index(size);
+	if (!(block = heap_fast_bins[bin]))
+		return NULL;
+	heap_fast_bins[bin] = FREE_LINKS(block)->next;
+	heap_totals.fast_size -= size;
+	heap_totals.fast_count--;
+	heap_note_usage();
+	return block;
+}
+
+/**
+ * @brief Frees all blocks in the fast bins, merging them with their free
+ * neighbours. The heap lock must be held.
+ *
+ * @return True if any block was freed, false otherwise.
+ */
+static bool heap_consolidate(void)
+{
+	heap_block *i;
+
+	if (!heap_totals.fast_count)
+		return false;
+	for (size_t bin = 0; bin < HEAP_FAST_BINS; bin++) {
+		while ((i = heap_fast_bins[bin])) {
+			heap_fast_bins[bin] = FREE_LINKS(i)->next;
+			do_free(i);
+		}
+	}
+	heap_totals.fast_size = 0;
+	heap_totals.fast_count = 0;
+	return true;
+}
+
+/**
+ * @brief Returns a block that is not kept in a fast bin to the heap, and
+ * trims the heap if its end grew past the trim threshold. The heap lock must
+ * be held.
+ *
+ * @param block Pointer to the block.
+ */
+static void heap_free_block(heap_block *block)
+{
+	if (block_size(do_free(block)) >= HEAP_FAST_CONSOLIDATE)
+		(void)heap_consolidate();
+	heap_auto_trim();
+}
+#else
+#define heap_fast_push(block) false
+#define heap_fast_pop(size) NULL
+#define heap_consolidate() false
+#define heap_free_block(block) ((void)do_free(block), heap_auto_trim())
+#endif
+
+/**
+ * @brief Allocates a block from the shared heap, expanding it if necessary.
+ *
+ * A block of the same size in a fast bin is taken first. If no free block
+ * fits, the fast bins are merged into the heap before it is expanded. The
+ * heap lock must be held.
+ *
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated heap block, or NULL if the allocation fails.
+ */
+static heap_block *heap_allocate(size_t size)
+{
+	heap_block *i = NULL;
+	while (true) {
+		if ((i = heap_fast_pop(size)) || (i = do_malloc(size)))
+			return i;
+		if (heap_consolidate())
+			continue;
+		if (!expand_heap(size))
+			return NULL;
+	}
+}
+
+/**
+ * @brief Adds a slab to a list of slabs.
+ *
+ * @param list Pointer to the head of the list.
+ * @param slab Pointer to the slab.
+ */
+static void slab_link(heap_slab **list, heap_slab *slab)
+{
+	slab->previous = NULL;
+	slab->next = *list;
+	if (slab->next)
+		slab->next->previous = slab;
+	*list = slab;
+}
+
+/**
+ * @brief Removes a slab from a list of slabs.
+ *
+ * @param list Pointer to the head of the list.
+ * @param slab Pointer to the slab.
+ */
+static void slab_unlink(heap_slab **list, heap_slab *slab)
+{
+	if (slab->previous)
+		slab->previous->next = slab->next;
+	else
+		*list = slab->next;
+	if (slab->next)
+		slab->next->previous = slab->previous;
+}
+
+/**
+ * @brief Creates an empty slab for a pool.
+ *
+ * The slab is allocated from the heap and added to the partial slabs of the
+ * pool. The heap lock must be held.
+ *
+ * @param pool Pointer to the pool.
+ * @return Pointer to the new slab, or NULL if the allocation fails.
+ */
+static heap_slab *slab_create(pool_t *pool)
+{
+	heap_block *block = heap_allocate(pool->slab_size);
+	heap_slab *slab;
+	size_t words = (pool->capacity + 63) / 64;
+
+	if (!block)
+		return NULL;
+	block->header &= ~HEAP_CLEAN;
+
+	slab = (heap_slab *)((uintptr_t)block + sizeof(heap_block));
+	slab->pool = pool;
+	slab->owner = NULL;
+	slab->free_count = pool->capacity;
+	for (size_t i = 0; i < words; i++)
+		slab->free_map[i] = ~0ull;
+	if (pool->capacity % 64)
+		slab->free_map[words - 1] = (1ull << (pool->capacity % 64)) - 1;
+	slab_link(&pool->partial, slab);
+	return slab;
+}
+
+/**
+ * @brief Sets up a pool for objects of the specified size.
+ *
+ * @param pool Pointer to the pool.
+ * @param size The size of the objects, as returned by heap_request_size().
+ */
+static void pool_setup(pool_t *pool, size_t size)
+{
+	size_t words;
+
+	pool->size = size;
+	pool->stride = size + sizeof(heap_block);
+	pool->slab_size = heap_request_size(
+		HEAP_SLAB_OBJECTS * pool->stride + sizeof(heap_slab) +
+		sizeof(uint64_t) + HEAP_ALIGNMENT);
+	if (pool->slab_size < HEAP_SLAB_SIZE)
+		pool->slab_size = HEAP_SLAB_SIZE;
+
+	pool->capacity = (pool->slab_size - sizeof(heap_slab)) / pool->stride;
+	do {
+		words = (pool->capacity + 63) / 64;
+		pool->offset = ((sizeof(heap_slab) + words * sizeof(uint64_t) +
+				 sizeof(heap_block) + HEAP_ALIGNMENT - 1) &
+				~(HEAP_ALIGNMENT - 1)) -
+			       sizeof(heap_block);
+	} while (pool->offset + pool->capacity * pool->stride >
+			 pool->slab_size &&
+		 pool->capacity--);
+
+	pool->cached = false;
+	pool->partial = NULL;
+	pool->full = NULL;
+}
+
+/**
+ * @brief Takes a free object from a pool.
+ *
+ * A new slab is created if no slab of the pool has free objects. The heap
+ * lock must be held.
+ *
+ * @param pool Pointer to the pool.
+ * @return Pointer to the tag of the object, or NULL if the allocation fails.
+ */
+static heap_block *pool_take(pool_t *pool)
+{
+	heap_slab *slab = pool->partial;
+	heap_block *object;
+	size_t index = 0;
+
+	if (!slab && !(slab = slab_create(pool)))
+		return NULL;
+
+	while (!slab->free_map[index / 64])
+		index += 64;
+	index += __builtin_ctzll(slab->free_map[index / 64]);
+	slab->free_map[index / 64] &= ~(1ull << (index % 64));
+	if (!--slab->free_count) {
+		slab_unlink(&pool->partial, slab);
+		slab_link(&pool->full, slab);
+	}
+
+	object = (heap_block *)((uintptr_t)slab + pool->offset +
+				index * pool->stride);
+	object->header =
+		((uintptr_t)object - (uintptr_t)slab + sizeof(heap_block)) |
+		HEAP_USED;
+	return object;
+}
+
+/**
+ * @brief Returns an object to its pool.
+ *
+ * A slab that becomes empty is returned to the heap, unless it is the only
+ * slab of the pool with free objects. The heap lock must be held.
+ *
+ * @param object Pointer to the tag of the object.
+ */
+static void pool_put(heap_block *object)
+{
+	heap_slab *slab = object_slab(object);
+	pool_t *pool = slab->pool;
+	size_t index = ((uintptr_t)object - (uintptr_t)slab - pool->offset) /
+		       pool->stride;
+
+	slab->free_map[index / 64] |= 1ull << (index % 64);
+	if (!slab->free_count++) {
+		slab_unlink(&pool->full, slab);
+		slab_link(&pool->partial, slab);
+	} else if (slab->free_count == pool->capacity &&
+		   (pool->partial != slab || slab->next)) {
+		slab_unlink(&pool->partial, slab);
+		do_free((heap_block *)((uintptr_t)slab - sizeof(heap_block)));
+	}
+}
+
+/**
+ * @brief Claims a remote queue for the calling thread. The heap lock must be
+ * held.
+ *
+ * @return Pointer to the queue, or NULL if all queues are taken.
+ */
+static heap_remote *heap_remote_claim(void)
+{
+	for (size_t i = 0; i < HEAP_REMOTE_QUEUES; i++) {
+		if (!heap_remotes[i].claimed) {
+			heap_remotes[i].claimed = true;
+			return &heap_remotes[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Pushes an object freed by another thread on the queue of its owner.
+ *
+ * @param remote Pointer to the queue.
+ * @param object Pointer to the tag of the object.
+ */
+static void heap_remote_push(heap_remote *remote, heap_block *object)
+{
+	heap_block *head = atomic_load_explicit(&remote->head,
+						memory_order_relaxed);
+
+	do {
+		FREE_LINKS(object)->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(
+		&remote->head, &head, object, memory_order_release,
+		memory_order_relaxed));
+}
+
+/**
+ * @brief Takes all objects from a remote queue.
+ *
+ * @param remote Pointer to the queue.
+ * @return The objects, chained through their next links.
+ */
+static heap_block *heap_remote_take(heap_remote *remote)
+{
+	if (!atomic_load_explicit(&remote->head, memory_order_relaxed))
+		return NULL;
+	return atomic_exchange_explicit(&remote->head, NULL,
+					memory_order_acquire);
+}
+
+/**
+ * @brief Tells whether an object belongs to the cache of another thread.
+ *
+ * Without per-thread caches, every thread uses the same cache, so no object
+ * is ever foreign.
+ *
+ * @param owner The owner of the slab of the object.
+ * @return True if the object must be pushed on the queue of its owner.
+ */
+static bool heap_remote_foreign(heap_remote *owner)
+{
+#ifdef HEAP_THREAD_CACHE
+	return owner && owner != tcache.remote;
+#else
+	(void)owner;
+	return false;
+#endif
+}
+
+/**
+ * @brief Refills the thread cache for a small size class.
+ *
+ * This function takes a batch of objects from the pool of the size class
+ * while holding the heap lock once. One object is returned to the caller and
+ * the rest are kept in the thread cache.
+ *
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the tag of the allocated object, or NULL if the allocation fails.
+ */
+static heap_block *tcache_refill(size_t size)
+{
+	size_t bin = size / HEAP_ALIGNMENT;
+	heap_block *block;
+	heap_block *i;
+
+	tcache_lock_heap();
+	if (!tcache.remote)
+		tcache.remote = heap_remote_claim();
+	block = pool_take(&heap_pools[bin]);
+	if (block)
+		atomic_store_explicit(&object_slab(block)->owner,
+				      tcache.remote, memory_order_relaxed);
+	for (size_t n = 1; block && n < TCACHE_BATCH; n++) {
+		if (!(i = pool_take(&heap_pools[bin])))
+			break;
+		atomic_store_explicit(&object_slab(i)->owner, tcache.remote,
+				      memory_order_relaxed);
+		FREE_LINKS(i)->next = tcache.blocks[bin];
+		tcache.blocks[bin] = i;
+		tcache.count[bin]++;
+	}
+	tcache_unlock_heap();
+	return block;
+}
+
+/**
+ * @brief Returns a batch of blocks from a full thread cache bin to the shared heap.
+ *
+ * @param bin The index of the thread cache bin.
+ */
+static void tcache_flush(size_t bin)
+{
+	heap_block *i;
+
+	tcache_lock_heap();
+	for (size_t n = 0; n < TCACHE_BATCH; n++) {
+		i = tcache.blocks[bin];
+		tcache.blocks[bin] = FREE_LINKS(i)->next;
+		tcache.count[bin]--;
+		if (block_is_object(i))
+			pool_put(i);
+		else
+			do_free(i);
+	}
+	heap_auto_trim();
+	tcache_unlock_heap();
+}
+
+/**
+ * @brief Returns all objects of a remote queue to their pools. The heap
+ * lock must be held.
+ *
+ * @param remote Pointer to the queue.
+ */
+static void heap_remote_release(heap_remote *remote)
+{
+	heap_block *i = heap_remote_take(remote);
+	heap_block *next;
+
+	for (; i; i = next) {
+		next = FREE_LINKS(i)->next;
+		pool_put(i);
+	}
+}
+
+/**
+ * @brief Puts a freed block or object in the thread cache.
+ *
+ * @param block Pointer to the block or to the tag of the object.
+ * @param bin The index of the thread cache bin.
+ */
+static void tcache_put(heap_block *block, size_t bin)
+{
+	tcache_acquire();
+	FREE_LINKS(block)->next = tcache.blocks[bin];
+	tcache.blocks[bin] = block;
+	if (++tcache.count[bin] > TCACHE_COUNT)
+		tcache_flush(bin);
+	tcache_release();
+}
+
+/**
+ * @brief Moves the objects freed by other threads to the thread cache.
+ */
+static void tcache_drain(void)
+{
+	heap_block *i = heap_remote_take(tcache.remote);
+	heap_block *next;
+	size_t bin;
+
+	for (; i; i = next) {
+		next = FREE_LINKS(i)->next;
+		bin = object_slab(i)->pool->size / HEAP_ALIGNMENT;
+		FREE_LINKS(i)->next = tcache.blocks[bin];
+		tcache.blocks[bin] = i;
+		if (++tcache.count[bin] > TCACHE_COUNT)
+			tcache_flush(bin);
+	}
+}
+
+/**
+ * @brief Initializes the heap.
+ * 
+ * This function initializes the heap by setting up its first region with a
+ * single free block. The region lies between __heap_start and __heap_end if
+ * the program defines them. Otherwise a region of the requested size is
+ * mapped from the kernel, or the heap starts from its seed region. It is
+ * only called by heap_setup(), once, since it discards every allocation.
+ *
+ * @param size The size of the first region, or 0 to map memory only when it
+ * is needed.
+ */
+static void heap_init(size_t size)
+{
+	heap_block *first_block;
+	uintptr_t region = (uintptr_t)heap_seed;
+	size_t region_size = sizeof(heap_seed);
+	size_t clean = HEAP_CLEAN;
+	uintptr_t start;
+	uintptr_t end;
+	void *pages;
+
+	start = ((uintptr_t)__heap_start + HEAP_ALIGNMENT - 1) &
+		~(uintptr_t)(HEAP_ALIGNMENT - 1);
+	end = (uintptr_t)__heap_end & ~(uintptr_t)(HEAP_ALIGNMENT - 1);
+	size = (size + HEAP_PAGE_SIZE - 1) & ~(size_t)(HEAP_PAGE_SIZE - 1);
+	if ((uintptr_t)__heap_start && end > start &&
+	    end - start >= sizeof(heap_seed)) {
+		region = start;
+		region_size = end - start;
+		clean = 0;
+	} else if (size > sizeof(heap_seed) && (pages = _map_pages(size))) {
+		region = (uintptr_t)pages;
+		region_size = size;
+	}
+
+	heap_start = region;
+	heap_end = region + region_size;
+	heap_first_start = region;
+	heap_first_end = region + region_size;
+
+	for (size_t i = 0; i < HEAP_BIN_COUNT; i++)
+		heap_bins[i] = NULL;
+	for (size_t i = 0; i < HEAP_BIN_WORDS; i++)
+		heap_bin_map[i] = 0;
+#ifdef HEAP_TLSF
+	heap_bin_summary = 0;
+#else
+	heap_tree = NULL;
+	for (size_t i = 0; i < HEAP_FAST_BINS; i++)
+		heap_fast_bins[i] = NULL;
+#endif
+	heap_totals = (heap_stats){ .region_size = region_size };
+
+	for (size_t i = 1; i < HEAP_SMALL_BINS; i++) {
+		pool_setup(&heap_pools[i],
+			   i * HEAP_ALIGNMENT + sizeof(heap_block));
+		heap_pools[i].cached = true;
+	}
+
+	heap_regions = (heap_region *)region;
+	heap_regions->previous = NULL;
+	heap_regions->size = region_size;
+
+	first_block = (heap_block *)(region + HEAP_REGION_OFFSET);
+	first_block->header = (region_size - HEAP_REGION_OFFSET -
+			       2 * sizeof(heap_block)) |
+			      clean | HEAP_PREVIOUS_USED;
+	heap_tail = block_next(first_block);
+	heap_tail->header = HEAP_USED;
+	heap_link_free(first_block);
+	heap_note_usage();
+	atomic_store_explicit(&heap_ready, true, memory_order_release);
+}
+
+/**
+ * @brief Initializes the heap on its first use, with the size given by
+ * __heap_size.
+ *
+ * Once the heap is set up, this costs a single load.
+ */
+static void heap_setup(void)
+{
+	if (atomic_load_explicit(&heap_ready, memory_order_acquire))
+		return;
+	heap_acquire();
+	if (!atomic_load_explicit(&heap_ready, memory_order_relaxed))
+		heap_init((size_t)__heap_size);
+	heap_release();
+}
+
+#ifdef HEAP_DEBUG
+/**
+ * @brief Computes the key that protects the header of an allocated block.
+ *
+ * The flags that change while the block is allocated are left out.
+ *
+ * @param block Pointer to the block, object or mapped block.
+ * @return The key of the block.
+ */
+static size_t heap_debug_key(heap_block *block)
+{
+	return ((block->header & ~(size_t)(HEAP_PREVIOUS_USED | HEAP_CLEAN)) ^
+		(uintptr_t)block) *
+	       HEAP_DEBUG_KEY;
+}
+
+/**
+ * @brief Returns the last word of an allocated block.
+ *
+ * @param block Pointer to the block, object or mapped block.
+ * @return Pointer to the last word of the block.
+ */
+static size_t *heap_debug_trailer(heap_block *block)
+{
+	return (size_t *)((uintptr_t)block + block_usable_size(block));
+}
+
+/**
+ * @brief Fills the end of a newly allocated block and records its size.
+ *
+ * @param ptr Pointer to the allocated memory.
+ * @param size The size that was requested.
+ */
+static void heap_debug_arm(void *ptr, size_t size)
+{
+	heap_block *block = (heap_block *)((uintptr_t)ptr - sizeof(heap_block));
+	size_t *trailer = heap_debug_trailer(block);
+
+	memset((uint8_t *)ptr + size, HEAP_DEBUG_FILL,
+	       (uintptr_t)trailer - (uintptr_t)ptr - size);
+	*trailer = size ^ heap_debug_key(block);
+}
+
+/**
+ * @brief Checks that the tag of a slab object leads to a slab.
+ *
+ * @param object Pointer to the tag of the object.
+ * @return True if the tag looks valid, false otherwise.
+ */
+static bool heap_debug_object_valid(heap_block *object)
+{
+	size_t offset = object->header & ~HEAP_FLAGS;
+	heap_block *block = (heap_block *)((uintptr_t)object - offset);
+	pool_t *pool;
+
+	if ((uintptr_t)block < heap_start ||
+	    (block->header & (HEAP_SIZE_BIT | HEAP_USED)) !=
+		    (HEAP_SIZE_BIT | HEAP_USED) ||
+	    block_size(block) < offset)
+		return false;
+	pool = object_slab(object)->pool;
+	return (pool >= heap_pools && pool < heap_pools + HEAP_SMALL_BINS) ||
+	       heap_contains(pool);
+}
+
+/**
+ * @brief Checks whether a slab object is free in its slab.
+ *
+ * @param object Pointer to the tag of the object.
+ * @return True if the object is free, false otherwise.
+ */
+static bool heap_debug_object_free(heap_block *object)
+{
+	heap_slab *slab = object_slab(object);
+	size_t index = ((uintptr_t)object - (uintptr_t)slab -
+			slab->pool->offset) /
+		       slab->pool->stride;
+
+	return slab->free_map[index / 64] & 1ull << (index % 64);
+}
+
+/**
+ * @brief Checks that a block passed to free or realloc is allocated and
+ * intact. The heap lock must be held.
+ *
+ * @param block Pointer to the block, object or mapped block.
+ * @param freeing Whether the block is being freed, in which case it is
+ * marked as freed.
+ * @return True if the block is valid, false if an error was reported.
+ */
+static bool heap_debug_verify(heap_block *block, bool freeing)
+{
+	void *ptr = (uint8_t *)block + sizeof(heap_block);
+	heap_mapping *mapping;
+	heap_region *region = NULL;
+	size_t *trailer;
+	size_t size;
+
+	for (mapping = heap_mappings; mapping; mapping = mapping->next)
+		if (&mapping->block == block)
+			break;
+	for (region = heap_regions; !mapping && region;
+	     region = region->previous)
+		if ((uintptr_t)block > (uintptr_t)region &&
+		    (uintptr_t)block < (uintptr_t)region + region->size)
+			break;
+
+	if (!mapping && !region) {
+		heap_error("invalid or double free", ptr);
+		return false;
+	} else if (mapping) {
+		if (!block_is_mapped(block)) {
+			heap_error("corrupted block header", ptr);
+			return false;
+		}
+	} else if (block_is_mapped(block)) {
+		heap_error("invalid or double free", ptr);
+		return false;
+	} else if (block_is_object(block) ? !heap_debug_object_valid(block) :
+					    block_size(block) >
+						    heap_end - (uintptr_t)ptr) {
+		heap_error("corrupted block header", ptr);
+		return false;
+	} else if (block_is_object(block) ? heap_debug_object_free(block) :
+					    !(block->header & HEAP_USED)) {
+		heap_error("double free", ptr);
+		return false;
+	}
+
+	trailer = heap_debug_trailer(block);
+	if (*trailer == HEAP_DEBUG_FREED) {
+		heap_error("double free", ptr);
+		return false;
+	}
+	size = *trailer ^ heap_debug_key(block);
+	if (size > (uintptr_t)trailer - (uintptr_t)ptr) {
+		heap_error("corrupted block header or trailer", ptr);
+		return false;
+	}
+	for (uint8_t *i = (uint8_t *)ptr + size; i < (uint8_t *)trailer; i++) {
+		if (*i != HEAP_DEBUG_FILL) {
+			heap_error("write past the end of a block", ptr);
+			return false;
+		}
+	}
+
+	if (freeing)
+		*trailer = HEAP_DEBUG_FREED;
+	return true;
+}
+
+/**
+ * @brief Checks that a block passed to free or realloc is allocated and
+ * intact, taking the heap lock.
+ *
+ * @param block Pointer to the block, object or mapped block.
+ * @param freeing Whether the block is being freed.
+ * @return True if the block is valid, false if an error was reported.
+ */
+static bool heap_debug_check(heap_block *block, bool freeing)
+{
+	bool valid;
+
+	heap_acquire();
+	valid = heap_debug_verify(block, freeing);
+	heap_release();
+	return valid;
+}
+
+/**
+ * @brief Checks the size and alignment passed to free_sized or
+ * free_aligned_sized against the allocation.
+ *
+ * @param ptr Pointer to the memory being freed.
+ * @param size The size given by the caller.
+ * @param alignment The alignment given by the caller.
+ * @return True if the block is valid and matches, false if an error was
+ * reported.
+ */
+static bool heap_debug_check_sized(void *ptr, size_t size, size_t alignment)
+{
+	if (!heap_debug_check((heap_block *)((uintptr_t)ptr -
+					     sizeof(heap_block)),
+			      false))
+		return false;
+	if (size > malloc_usable_size(ptr)) {
+		heap_error("size larger than the allocation", ptr);
+		return false;
+	}
+	if (!alignment || (uintptr_t)ptr % alignment) {
+		heap_error("alignment does not match the allocation", ptr);
+		return false;
+	}
+	return true;
+}
+#else
+#define heap_debug_arm(ptr, size) ((void)0)
+#define heap_debug_verify(block, freeing) true
+#define heap_debug_check(block, freeing) true
+#define heap_debug_check_sized(ptr, size, alignment) true
+#endif
+
+/**
+ * @brief Counts an allocation towards the sampling interval of the heap
+ * profiler, and samples it once the interval is reached.
+ *
+ * Entry points pass their own frame, so that the call stack of a sample
+ * starts at the caller of the allocator.
+ *
+ * @param ptr Pointer to the allocated memory.
+ * @param size The size of the allocation.
+ * @param frame The frame of the allocator function called by the program.
+ */
+static void heap_profile_count(void *ptr, size_t size, void *frame)
+{
+	size_t interval = atomic_load_explicit(&_profile_interval,
+					       memory_order_relaxed);
+	size_t countdown;
+
+	if (!interval)
+		return;
+	countdown = atomic_load_explicit(&profile_countdown,
+					 memory_order_relaxed);
+	if (size < countdown) {
+		atomic_store_explicit(&profile_countdown, countdown - size,
+				      memory_order_relaxed);
+		return;
+	}
+	atomic_store_explicit(&profile_countdown, interval,
+			      memory_order_relaxed);
+	_profile_sample(ptr, size, frame);
+}
+
+/**
+ * @brief Tells the heap profiler that memory is being freed, if it tracks
+ * any sampled allocations.
+ *
+ * @param ptr Pointer to the memory being freed.
+ */
+static void heap_profile_free(void *ptr)
+{
+	if (atomic_load_explicit(&_profile_live_count, memory_order_relaxed))
+		_profile_forget(ptr);
+}
+
+/**
+ * @brief Logs a call to the allocator if the tracer is running.
+ *
+ * @param op The operation, one of the HEAP_TRACE_* values.
+ * @param size The size that was requested.
+ * @param ptr The pointer that was returned or freed.
+ * @param old The pointer passed to realloc().
+ * @param alignment The alignment that was requested.
+ */
+static void heap_trace(int op, size_t size, void *ptr, void *old,
+		       size_t alignment)
+{
+	if (atomic_load_explicit(&_trace_enabled, memory_order_relaxed))
+		_trace_record(op, size, ptr, old, alignment);
+}
+
+/**
+ * @brief Allocates a heap block for a request of the specified size.
+ *
+ * Small blocks are objects taken from the thread cache or the pool of their
+ * size class, and large blocks get a mapping of their own. If the allocation
+ * fails, it attempts to expand the heap to accommodate the requested memory
+ * size. The block keeps its clean flag.
+ *
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated heap block, or NULL if the allocation fails.
+ */
+static heap_block *malloc_block(size_t size)
+{
+	heap_block *i = NULL;
+	size_t bin;
+
+	heap_setup();
+	if (!(size = heap_request_size(size)))
+		return NULL;
+
+	if (size < HEAP_SMALL_LIMIT) {
+		bin = size / HEAP_ALIGNMENT;
+		tcache_acquire();
+		if (!tcache.blocks[bin] && tcache.remote)
+			tcache_drain();
+		if ((i = tcache.blocks[bin])) {
+			tcache.blocks[bin] = FREE_LINKS(i)->next;
+			tcache.count[bin]--;
+		} else {
+			i = tcache_refill(size);
+		}
+		tcache_release();
+	} else if (size >= HEAP_MAP_THRESHOLD) {
+		i = heap_map(size, HEAP_ALIGNMENT);
+	} else {
+		heap_acquire();
+		i = heap_allocate(size);
+		heap_release();
+	}
+	return i;
+}
+
+/**
+ * @brief Allocates a block of memory on the heap without tracing or
+ * profiling the call.
+ *
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL if the allocation fails.
+ */
+static void *heap_malloc(size_t size)
+{
+	heap_block *i = malloc_block(size);
+	if (!i)
+		return NULL;
+	i->header &= ~HEAP_CLEAN;
+	heap_debug_arm((uint8_t *)i + sizeof(heap_block), size);
+	return (uint8_t *)i + sizeof(heap_block);
+}
+
+/**
+ * @brief Allocates a block of memory on the heap.
+ *
+ * This function allocates a block of memory of the specified size on the heap.
+ * Small blocks are taken from the thread cache when possible. If the
+ * allocation fails, it attempts to expand the heap to accommodate the
+ * requested memory size.
+ *
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL if the allocation fails.
+ */
+void *malloc(size_t size)
+{
+	void *ptr = heap_malloc(size);
+
+	if (ptr) {
+		heap_profile_count(ptr, size, __builtin_frame_address(0));
+		heap_trace(HEAP_TRACE_MALLOC, size, ptr, NULL, 0);
+	}
+	return ptr;
+}
+
+/**
+ * @brief Allocates zero-initialized memory for an array on the heap.
+ *
+ * Blocks that are known to be clean only need the allocator metadata in
+ * their payload cleared, and mapped blocks come straight from the kernel, so
+ * large zeroed buffers from fresh memory cost no more than malloc().
+ *
+ * @param nmemb The number of elements.
+ * @param size The size of each element.
+ * @return A pointer to the allocated memory block, or NULL if the allocation
+ *         fails or nmemb * size overflows.
+ */
+void *calloc(size_t nmemb, size_t size)
+{
+	heap_block *i;
+	uint8_t *ptr;
+	size_t total;
+
+	if (__builtin_mul_overflow(nmemb, size, &total))
+		return NULL;
+	if (!(i = malloc_block(total)))
+		return NULL;
+
+	ptr = (uint8_t *)i + sizeof(heap_block);
+	if (i->header & HEAP_CLEAN) {
+		memset(ptr, 0,
+		       block_size(i) < HEAP_FREE_METADATA ? block_size(i) :
+							    HEAP_FREE_METADATA);
+		memset(ptr + block_size(i) - sizeof(size_t), 0, sizeof(size_t));
+		i->header &= ~HEAP_CLEAN;
+	} else if (!block_is_mapped(i)) {
+		memset(ptr, 0, total);
+	}
+	heap_debug_arm(ptr, total);
+	heap_profile_count(ptr, total, __builtin_frame_address(0));
+	heap_trace(HEAP_TRACE_CALLOC, total, ptr, NULL, 0);
+	return ptr;
+}
+
+/**
+ * @brief Allocates a block of memory with the specified alignment.
+ *
+ * This function allocates a block large enough to hold an aligned block of
+ * the requested size after a leading gap that can form a block of its own.
+ * The gap before the aligned block and the space after it are split off and
+ * returned to the heap, so no memory is wasted on padding. Blocks of at least
+ * HEAP_MAP_THRESHOLD bytes get an aligned mapping of their own instead, like
+ * those from malloc(). The call is not traced or profiled.
+ *
+ * @param alignment The alignment, a power of two.
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL if the allocation fails.
+ */
+static void *heap_aligned_alloc(size_t alignment, size_t size)
+{
+	heap_block *i;
+	heap_block *aligned;
+	size_t request;
+	uintptr_t ptr;
+	uintptr_t aligned_ptr;
+
+	if (alignment <= HEAP_ALIGNMENT)
+		return heap_malloc(size);
+	if (alignment > SIZE_MAX / 4 || !(request = heap_request_size(size)))
+		return NULL;
+
+	heap_setup();
+	if (request >= HEAP_MAP_THRESHOLD) {
+		if (!(i = heap_map(request, alignment)))
+			return NULL;
+		aligned_ptr = (uintptr_t)i + sizeof(heap_block);
+		heap_debug_arm((void *)aligned_ptr, size);
+		return (void *)aligned_ptr;
+	}
+
+	heap_acquire();
+	i = heap_allocate(request + alignment + sizeof(heap_block) +
+			  HEAP_MIN_SIZE);
+	if (!i) {
+		heap_release();
+		return NULL;
+	}
+
+	ptr = (uintptr_t)i + sizeof(heap_block);
+	aligned_ptr = (ptr + alignment - 1) & ~(alignment - 1);
+	while (aligned_ptr != ptr &&
+	       aligned_ptr - ptr < sizeof(heap_block) + HEAP_MIN_SIZE)
+		aligned_ptr += alignment;
+
+	aligned = i;
+	if (aligned_ptr != ptr) {
+		heap_split_block(i, aligned_ptr - ptr - sizeof(heap_block));
+		aligned = block_next(i);
+		aligned->header |= HEAP_USED;
+		block_next(aligned)->header |= HEAP_PREVIOUS_USED;
+		do_free(i);
+	}
+	heap_shrink_block(aligned, request);
+	aligned->header &= ~HEAP_CLEAN;
+	heap_release();
+
+	heap_debug_arm((void *)aligned_ptr, size);
+	return (void *)aligned_ptr;
+}
+
+/**
+ * @brief Allocates a block of memory with the specified alignment.
+ *
+ * @param alignment The alignment, a power of two.
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL if the alignment is
+ *         invalid or the allocation fails.
+ */
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (!alignment || alignment & (alignment - 1))
+		return NULL;
+	if ((ptr = heap_aligned_alloc(alignment, size))) {
+		heap_profile_count(ptr, size, __builtin_frame_address(0));
+		heap_trace(HEAP_TRACE_ALIGNED, size, ptr, NULL, alignment);
+	}
+	return ptr;
+}
+
+/**
+ * @brief Allocates a block of memory with the specified alignment.
+ *
+ * @param memptr Pointer to where the address of the allocated memory is stored.
+ * @param alignment The alignment, a power of two multiple of sizeof(void *).
+ * @param size The size of the memory block to allocate.
+ * @return 0 on success, EINVAL if the alignment is invalid, or ENOMEM if the
+ *         allocation fails.
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (alignment < sizeof(void *) || alignment & (alignment - 1))
+		return EINVAL;
+	if (!(ptr = heap_aligned_alloc(alignment, size)))
+		return ENOMEM;
+	heap_profile_count(ptr, size, __builtin_frame_address(0));
+	heap_trace(HEAP_TRACE_ALIGNED, size, ptr, NULL, alignment);
+	*memptr = ptr;
+	return 0;
+}
+
+/**
+ * @brief Allocates a block of memory with the specified alignment.
+ *
+ * @param alignment The alignment, a power of two.
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL if the alignment is
+ *         invalid or the allocation fails.
+ */
+void *memalign(size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (!alignment || alignment & (alignment - 1))
+		return NULL;
+	if ((ptr = heap_aligned_alloc(alignment, size))) {
+		heap_profile_count(ptr, size, __builtin_frame_address(0));
+		heap_trace(HEAP_TRACE_ALIGNED, size, ptr, NULL, alignment);
+	}
+	return ptr;
+}
+
+/**
+ * @brief Frees memory without tracing the call.
+ *
+ * @param ptr Pointer to the memory to be freed.
+ */
+static void heap_free(void *ptr)
+{
+	heap_block *i = (heap_block *)((uintptr_t)ptr - sizeof(heap_block));
+	heap_remote *owner;
+	pool_t *pool;
+	size_t size;
+
+	if (!heap_contains(ptr) || !heap_debug_check(i, true))
+		return;
+	heap_profile_free(ptr);
+
+	if (block_is_mapped(i)) {
+		heap_unmap(i);
+		return;
+	} else if (block_is_object(i)) {
+		pool = object_slab(i)->pool;
+		if (!pool->cached) {
+			heap_acquire();
+			pool_put(i);
+			heap_release();
+			return;
+		}
+		owner = atomic_load_explicit(&object_slab(i)->owner,
+					     memory_order_relaxed);
+		if (heap_remote_foreign(owner)) {
+			heap_remote_push(owner, i);
+			return;
+		}
+		size = pool->size;
+	} else {
+		size = block_size(i);
+	}
+
+	if (size < HEAP_SMALL_LIMIT) {
+		tcache_put(i, size / HEAP_ALIGNMENT);
+		return;
+	}
+
+	heap_acquire();
+	if (!heap_fast_push(i))
+		heap_free_block(i);
+	heap_release();
+}
+
+/**
+ * @brief Frees the memory space pointed to by ptr, which must have been returned by a previous call to malloc().
+ *
+ * Small blocks and objects of the size class pools are kept in the thread
+ * cache for reuse. Objects cached by another thread are handed back to that
+ * thread through its remote queue.
+ *
+ * @param ptr Pointer to the memory to be freed.
+ */
+void free(void *ptr)
+{
+	if (heap_contains(ptr))
+		heap_trace(HEAP_TRACE_FREE, 0, ptr, NULL, 0);
+	heap_free(ptr);
+}
+
+#ifdef HEAP_DEBUG
+/**
+ * @brief Frees memory whose size and alignment are known, without tracing
+ * the call. Debug builds check both against the allocation before freeing
+ * it like free().
+ *
+ * @param ptr Pointer to the memory to be freed.
+ * @param size The size that was requested when the memory was allocated.
+ * @param alignment The alignment of the memory.
+ */
+static void heap_free_sized(void *ptr, size_t size, size_t alignment)
+{
+	if (heap_contains(ptr) && !heap_debug_check_sized(ptr, size, alignment))
+		return;
+	heap_free(ptr);
+}
+#else
+/**
+ * @brief Frees memory whose size and alignment are known, without tracing
+ * the call.
+ *
+ * Small allocations are objects of the pool of their size class, so their
+ * thread cache bin follows from the size and the pool of the slab does not
+ * have to be read. Objects cached by another thread and all other blocks
+ * are freed like free() does.
+ *
+ * @param ptr Pointer to the memory to be freed.
+ * @param size The size that was requested when the memory was allocated.
+ * @param alignment The alignment of the memory.
+ */
+static void heap_free_sized(void *ptr, size_t size, size_t alignment)
+{
+	heap_block *i = (heap_block *)((uintptr_t)ptr - sizeof(heap_block));
+	size_t request = heap_request_size(size);
+
+	(void)alignment;
+	if (!heap_contains(ptr) || !request || request >= HEAP_SMALL_LIMIT ||
+	    !block_is_object(i) ||
+	    heap_remote_foreign(atomic_load_explicit(&object_slab(i)->owner,
+						     memory_order_relaxed))) {
+		heap_free(ptr);
+		return;
+	}
+	heap_profile_free(ptr);
+	tcache_put(i, request / HEAP_ALIGNMENT);
+}
+#endif
+
+/**
+ * @brief Frees memory whose size is known to the caller.
+ *
+ * The size picks the thread cache bin of small allocations directly. Debug
+ * builds report a size larger than the allocation.
+ *
+ * @param ptr Pointer to the memory to be freed.
+ * @param size The size that was requested when the memory was allocated.
+ */
+void free_sized(void *ptr, size_t size)
+{
+	if (heap_contains(ptr))
+		heap_trace(HEAP_TRACE_FREE, 0, ptr, NULL, 0);
+	heap_free_sized(ptr, size, 1);
+}
+
+/**
+ * @brief Frees memory from aligned_alloc whose size and alignment are known
+ * to the caller.
+ *
+ * Debug builds also report memory that does not have the alignment.
+ *
+ * @param ptr Pointer to the memory to be freed.
+ * @param alignment The alignment that was requested for the memory.
+ * @param size The size that was requested when the memory was allocated.
+ */
+void free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+	if (heap_contains(ptr))
+		heap_trace(HEAP_TRACE_FREE, 0, ptr, NULL, 0);
+	heap_free_sized(ptr, size, alignment);
+}
+
+/**
+ * @brief Returns the number of bytes that can be used in an allocation.
+ *
+ * The result is at least the size that was requested and may be larger.
+ * All of it can be used without calling realloc(). Debug builds return the
+ * requested size, since the rest of the block is checked for overwrites.
+ *
+ * @param ptr Pointer to the allocated memory.
+ * @return The usable size, or 0 if ptr is NULL or not from the heap.
+ */
+size_t malloc_usable_size(void *ptr)
+{
+	heap_block *block = (heap_block *)((uintptr_t)ptr - sizeof(heap_block));
+
+	if (!heap_contains(ptr))
+		return 0;
+#ifdef HEAP_DEBUG
+	return *heap_debug_trailer(block) ^ heap_debug_key(block);
+#else
+	return block_usable_size(block);
+#endif
+}
+
+/**
+ * @brief Allocates several blocks of the same size at once.
+ *
+ * The thread cache is used first, then the rest of the blocks are taken
+ * from the heap with a single acquisition of the heap lock.
+ *
+ * @param size The size of each block in bytes.
+ * @param n The number of blocks to allocate.
+ * @param out Array that receives pointers to the allocated blocks.
+ * @return The number of blocks allocated, which is less than n only if
+ * memory ran out.
+ */
+size_t malloc_batch(size_t size, size_t n, void **out)
+{
+	size_t request = heap_request_size(size);
+	size_t count = 0;
+	size_t bin;
+	heap_block *i;
+
+	if (!request)
+		return 0;
+
+	heap_setup();
+	if (request < HEAP_SMALL_LIMIT) {
+		bin = request / HEAP_ALIGNMENT;
+		tcache_acquire();
+		if (tcache.remote)
+			tcache_drain();
+		while (count < n && (i = tcache.blocks[bin])) {
+			tcache.blocks[bin] = FREE_LINKS(i)->next;
+			tcache.count[bin]--;
+			out[count++] = (uint8_t *)i + sizeof(heap_block);
+		}
+		tcache_release();
+		heap_acquire();
+		while (count < n && (i = pool_take(&heap_pools[bin])))
+			out[count++] = (uint8_t *)i + sizeof(heap_block);
+		heap_release();
+	} else if (request >= HEAP_MAP_THRESHOLD) {
+		while (count < n && (i = heap_map(request, HEAP_ALIGNMENT)))
+			out[count++] = (uint8_t *)i + sizeof(heap_block);
+	} else {
+		heap_acquire();
+		while (count < n && (i = heap_allocate(request))) {
+			i->header &= ~HEAP_CLEAN;
+			out[count++] = (uint8_t *)i + sizeof(heap_block);
+		}
+		heap_release();
+	}
+	for (size_t k = 0; k < count; k++) {
+		heap_debug_arm(out[k], size);
+		heap_profile_count(out[k], size, __builtin_frame_address(0));
+		heap_trace(HEAP_TRACE_MALLOC, size, out[k], NULL, 0);
+	}
+	return count;
+}
+
+/**
+ * @brief Frees several blocks at once.
+ *
+ * Blocks that stay in the heap are all freed with a single acquisition of
+ * the heap lock, bypassing the thread cache.
+ *
+ * @param ptrs Array of pointers to the blocks to free. NULL entries are
+ * ignored.
+ * @param n The number of pointers in the array.
+ */
+void free_batch(void **ptrs, size_t n)
+{
+	heap_block *i;
+
+	heap_setup();
+	heap_acquire();
+	for (size_t k = 0; k < n; k++) {
+		i = (heap_block *)((uintptr_t)ptrs[k] - sizeof(heap_block));
+		if (!heap_contains(ptrs[k]) || !heap_debug_verify(i, true))
+			continue;
+		heap_profile_free(ptrs[k]);
+		heap_trace(HEAP_TRACE_FREE, 0, ptrs[k], NULL, 0);
+		if (block_is_mapped(i)) {
+			heap_release();
+			heap_unmap(i);
+			heap_acquire();
+		} else if (block_is_object(i)) {
+			pool_put(i);
+		} else {
+			do_free(i);
+		}
+	}
+	heap_auto_trim();
+	heap_release();
+}
+
+/**
+ * @brief Changes the size of a memory block allocated by malloc().
+ *
+ * The block is resized in place when possible: shrinking returns the tail of
+ * the block to the heap, and growing absorbs the following block if it is
+ * free. Objects in slabs and mapped blocks keep their size as long as the
+ * new size fits. Otherwise a new block is allocated, the contents are copied, and the
+ * old block is freed.
+ *
+ * @param ptr Pointer to the memory to resize, or NULL to allocate new memory.
+ * @param size The new size of the memory block.
+ * @return A pointer to the resized memory block, or NULL if the allocation fails,
+ *         in which case the original block is left untouched.
+ */
+void *realloc(void *ptr, size_t size)
+{
+	heap_block *i = (heap_block *)((uintptr_t)ptr - sizeof(heap_block));
+	size_t block_request = heap_request_size(size);
+	size_t old_size;
+	bool resized;
+	void *new_ptr;
+
+	if (!ptr) {
+		if ((new_ptr = heap_malloc(size))) {
+			heap_profile_count(new_ptr, size,
+					   __builtin_frame_address(0));
+			heap_trace(HEAP_TRACE_MALLOC, size, new_ptr, NULL, 0);
+		}
+		return new_ptr;
+	}
+	if (!heap_contains(ptr) || !block_request ||
+	    !heap_debug_check(i, false))
+		return NULL;
+
+	old_size = block_usable_size(i);
+	if (block_is_mapped(i)) {
+		resized = old_size >= block_request &&
+			  block_request >= HEAP_MAP_THRESHOLD;
+	} else if (block_is_object(i)) {
+		resized = old_size >= block_request;
+	} else {
+		heap_acquire();
+		if (old_size >= block_request) {
+			heap_shrink_block(i, block_request);
+			resized = true;
+		} else {
+			resized = heap_grow_block(i, block_request);
+		}
+		heap_release();
+	}
+	if (resized) {
+		heap_debug_arm(ptr, size);
+		heap_trace(HEAP_TRACE_REALLOC, size, ptr, ptr, 0);
+		return ptr;
+	}
+
+	if (!(new_ptr = heap_malloc(size)))
+		return NULL;
+	heap_profile_count(new_ptr, size, __builtin_frame_address(0));
+	memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+	heap_trace(HEAP_TRACE_REALLOC, size, new_ptr, ptr, 0);
+	heap_free(ptr);
+	return new_ptr;
+}
+
+/**
+ * @brief Returns free memory at the end of the heap to the kernel.
+ *
+ * Objects left in the remote queues of exited threads are returned to
+ * their pools first, and the fast bins are merged into the heap.
+ *
+ * @param pad Number of free bytes to keep at the end of the heap.
+ * @return 1 if any memory was released, 0 otherwise.
+ */
+int malloc_trim(size_t pad)
+{
+	bool trimmed;
+
+	heap_setup();
+	heap_acquire();
+	for (size_t i = 0; i < HEAP_REMOTE_QUEUES; i++)
+		if (!heap_remotes[i].claimed)
+			heap_remote_release(&heap_remotes[i]);
+	(void)heap_consolidate();
+	trimmed = heap_trim(pad);
+	heap_release();
+	return trimmed;
+}
+
+/**
+ * @brief Returns the thread cache of the calling thread to the heap.
+ *
+ * This must be called by a thread before it exits, so that the blocks in
+ * its cache are not lost and its remote queue can be used by another
+ * thread. Objects freed by other threads after this call are returned by
+ * the next owner of the queue or by malloc_trim().
+ */
+void heap_thread_exit(void)
+{
+	heap_block *i;
+
+	heap_setup();
+	heap_acquire();
+	if (tcache.remote) {
+		heap_remote_release(tcache.remote);
+		tcache.remote->claimed = false;
+		tcache.remote = NULL;
+	}
+	for (size_t bin = 0; bin < HEAP_SMALL_BINS; bin++) {
+		while ((i = tcache.blocks[bin])) {
+			tcache.blocks[bin] = FREE_LINKS(i)->next;
+			if (block_is_object(i))
+				pool_put(i);
+			else
+				do_free(i);
+		}
+		tcache.count[bin] = 0;
+	}
+	heap_auto_trim();
+	heap_release();
+}
+
+/**
+ * @brief Checks the free blocks of one heap bin. The heap lock must be held.
+ *
+ * @param bin The index of the bin.
+ * @param count Incremented by the number of blocks in the bin.
+ * @param bytes Incremented by the size of the blocks in the bin.
+ * @return True if the bin is consistent, false otherwise.
+ */
+static bool heap_check_bin(size_t bin, size_t *count, size_t *bytes)
+{
+	heap_block *previous = NULL;
+	bool mapped = heap_bin_map[bin / 64] & 1ull << (bin % 64);
+
+	if (mapped != !!heap_bins[bin])
+		return false;
+	for (heap_block *i = heap_bins[bin]; i; i = FREE_LINKS(i)->next) {
+		if (*count >= heap_totals.free_count ||
+		    i->header & HEAP_USED ||
+		    heap_bin_index(block_size(i)) != bin ||
+		    FREE_LINKS(i)->previous != previous)
+			return false;
+		(*count)++;
+		*bytes += block_size(i);
+		previous = i;
+	}
+	return true;
+}
+
+#ifndef HEAP_TLSF
+/**
+ * @brief Checks the blocks of one fast bin. The heap lock must be held.
+ *
+ * @param bin The index of the fast bin.
+ * @param count Incremented by the number of blocks in the bin.
+ * @param bytes Incremented by the size of the blocks in the bin.
+ * @return True if the bin is consistent, false otherwise.
+ */
+static bool heap_check_fast(size_t bin, size_t *count, size_t *bytes)
+{
+	for (heap_block *i = heap_fast_bins[bin]; i; i = FREE_LINKS(i)->next) {
+		if (*count >= heap_totals.fast_count ||
+		    !(i->header & HEAP_USED) ||
+		    block_size(i) < HEAP_SMALL_LIMIT ||
+		    block_size(i) >= HEAP_FAST_LIMIT ||
+		    heap_fast_index(block_size(i)) != bin)
+			return false;
+		(*count)++;
+		*bytes += block_size(i);
+	}
+	return true;
+}
+
+/**
+ * @brief Checks a subtree of the tree of large free blocks. The heap lock
+ * must be held.
+ *
+ * @param block The root of the subtree, or NULL.
+ * @param parent The expected parent of the root.
+ * @param previous The last block visited in order, updated as the subtree
+ * is walked.
+ * @param count Incremented by the number of blocks in the subtree.
+ * @param bytes Incremented by the size of the blocks in the subtree.
+ * @return The number of black blocks on every path down the subtree, or -1
+ * if the subtree is inconsistent.
+ */
+static int heap_check_tree(heap_block *block, heap_block *parent,
+			   heap_block **previous, size_t *count, size_t *bytes)
+{
+	heap_tree_links *links;
+	int left;
+	int right;
+
+	if (!block)
+		return 0;
+	links = TREE_LINKS(block);
+	if (links->parent != parent || (parent && links->red &&
+					 TREE_LINKS(parent)->red))
+		return -1;
+	left = heap_check_tree(links->left, block, previous, count, bytes);
+	if (left < 0 || *count >= heap_totals.free_count ||
+	    block->header & HEAP_USED ||
+	    block_size(block) < HEAP_SMALL_LIMIT ||
+	    (*previous && !heap_tree_less(*previous, block)))
+		return -1;
+	(*count)++;
+	*bytes += block_size(block);
+	*previous = block;
+	right = heap_check_tree(links->right, block, previous, count, bytes);
+	if (right != left)
+		return -1;
+	return left + !links->red;
+}
+#endif
+
+/**
+ * @brief Checks the blocks of one heap region. The heap lock must be held.
+ *
+ * @param region Pointer to the region.
+ * @param count Incremented by the number of free blocks in the region.
+ * @return True if the region is consistent, false otherwise.
+ */
+static bool heap_check_region(heap_region *region, size_t *count)
+{
+	heap_block *i = (heap_block *)((uintptr_t)region + HEAP_REGION_OFFSET);
+	uintptr_t end = (uintptr_t)region + region->size - sizeof(heap_block);
+	bool previous_used = true;
+
+	while (block_size(i)) {
+		if (!(i->header & HEAP_SIZE_BIT) ||
+		    block_size(i) > end - (uintptr_t)i - sizeof(heap_block) ||
+		    !(i->header & HEAP_PREVIOUS_USED) != !previous_used)
+			return false;
+		if (!(i->header & HEAP_USED)) {
+			if (!previous_used ||
+			    *(size_t *)((uintptr_t)block_next(i) -
+					sizeof(size_t)) != block_size(i))
+				return false;
+			(*count)++;
+		}
+		previous_used = i->header & HEAP_USED;
+		i = block_next(i);
+	}
+	return (uintptr_t)i == end && i->header & HEAP_USED &&
+	       !(i->header & HEAP_PREVIOUS_USED) == !previous_used;
+}
+
+/**
+ * @brief Checks the free object count of a slab against its bitmap.
+ *
+ * @param pool Pointer to the pool the slab belongs to.
+ * @param slab Pointer to the slab.
+ * @return True if the slab is consistent, false otherwise.
+ */
+static bool heap_check_slab(pool_t *pool, heap_slab *slab)
+{
+	size_t free_count = 0;
+
+	for (size_t word = 0; word * 64 < pool->capacity; word++)
+		free_count += __builtin_popcountll(slab->free_map[word]);
+	return slab->pool == pool && slab->free_count == free_count;
+}
+
+/**
+ * @brief Checks the consistency of the whole heap.
+ *
+ * Every block of every region, the free lists, tree and fast bins, the slabs
+ * of the size class pools and the list of mapped blocks are checked against
+ * each other and against the running totals.
+ *
+ * @return 0 if the heap is consistent, -1 if it is corrupted.
+ */
+int heap_check(void)
+{
+	size_t free_count = 0;
+	size_t region_free = 0;
+	size_t free_size = 0;
+	size_t mapped_size = 0;
+	size_t mapped_count = 0;
+	heap_mapping *previous = NULL;
+	heap_slab *slab;
+	bool valid = true;
+#ifndef HEAP_TLSF
+	heap_block *previous_free = NULL;
+	size_t fast_count = 0;
+	size_t fast_size = 0;
+#endif
+
+	heap_setup();
+	heap_acquire();
+	for (heap_region *i = heap_regions; valid && i; i = i->previous)
+		valid = heap_check_region(i, &region_free);
+	valid = valid && (uintptr_t)heap_tail == (uintptr_t)heap_regions +
+							 heap_regions->size -
+							 sizeof(heap_block);
+
+	for (size_t bin = 0; valid && bin < HEAP_BIN_COUNT; bin++)
+		valid = heap_check_bin(bin, &free_count, &free_size);
+#ifndef HEAP_TLSF
+	valid = valid && !heap_tree_red(heap_tree) &&
+		heap_check_tree(heap_tree, NULL, &previous_free, &free_count,
+				&free_size) >= 0;
+	for (size_t bin = 0; valid && bin < HEAP_FAST_BINS; bin++)
+		valid = heap_check_fast(bin, &fast_count, &fast_size);
+	valid = valid && fast_count == heap_totals.fast_count &&
+		fast_size == heap_totals.fast_size;
+#endif
+	valid = valid && free_count == region_free &&
+		free_count == heap_totals.free_count &&
+		free_size == heap_totals.free_size;
+
+	for (size_t bin = 1; valid && bin < HEAP_SMALL_BINS; bin++) {
+		for (slab = heap_pools[bin].partial; valid && slab;
+		     slab = slab->next)
+			valid = heap_check_slab(&heap_pools[bin], slab) &&
+				slab->free_count;
+		for (slab = heap_pools[bin].full; valid && slab;
+		     slab = slab->next)
+			valid = heap_check_slab(&heap_pools[bin], slab) &&
+				!slab->free_count;
+	}
+
+	for (heap_mapping *i = heap_mappings; valid && i; i = i->next) {
+		valid = i->previous == previous &&
+			i->block.header == (HEAP_MAPPED | HEAP_USED) &&
+			mapped_count < heap_totals.mapped_count;
+		mapped_size += i->size;
+		mapped_count++;
+		previous = i;
+	}
+	valid = valid && mapped_size == heap_totals.mapped_size &&
+		mapped_count == heap_totals.mapped_count;
+	heap_release();
+
+	return valid ? 0 : -1;
+}
+
+/**
+ * @brief Sets the function called when a debug build finds heap corruption.
+ *
+ * The handler is called with the heap locked, so it must not allocate or
+ * free memory. If it returns, the operation that found the error is
+ * skipped where possible, and the program is stopped otherwise. Without a
+ * handler, the program is stopped.
+ *
+ * @param handler The function to call, or NULL to stop the program.
+ */
+void heap_set_error_handler(void (*handler)(const char *message, void *ptr))
+{
+	heap_acquire();
+	heap_error_handler = handler;
+	heap_release();
+}
+
+/**
+ * @brief Changes a tunable parameter of the allocator.
+ *
+ * With HEAP_TLSF, the heap is only trimmed by malloc_trim, so the trim
+ * threshold has no effect.
+ *
+ * @param param The parameter to change, M_TRIM_THRESHOLD or M_TOP_PAD.
+ * @param value The new value of the parameter.
+ * @return 1 on success, 0 if the parameter or value is invalid.
+ */
+int mallopt(int param, int value)
+{
+	if (value < 0)
+		return 0;
+
+	heap_acquire();
+	switch (param) {
+	case M_TRIM_THRESHOLD:
+		heap_trim_threshold = value;
+		break;
+	case M_TOP_PAD:
+		heap_top_pad = value;
+		break;
+	default:
+		heap_release();
+		return 0;
+	}
+	heap_release();
+	return 1;
+}
+
+/**
+ * @brief Returns statistics about the memory used by the allocator.
+ *
+ * Memory held in slabs and thread caches counts as allocated.
+ *
+ * @return A mallinfo2 structure filled with the current statistics.
+ */
+struct mallinfo2 mallinfo2(void)
+{
+	struct mallinfo2 info;
+
+	heap_setup();
+	heap_acquire();
+	info.arena = heap_totals.region_size;
+	info.ordblks = heap_totals.free_count;
+	info.smblks = heap_totals.fast_count;
+	info.hblks = heap_totals.mapped_count;
+	info.hblkhd = heap_totals.mapped_size;
+	info.usmblks = heap_totals.peak;
+	info.fsmblks = heap_totals.fast_size;
+	info.uordblks = heap_totals.region_size - heap_totals.free_size -
+			heap_totals.fast_size;
+	info.fordblks = heap_totals.free_size + heap_totals.fast_size;
+	info.keepcost = heap_tail->header & HEAP_PREVIOUS_USED ?
+				0 :
+				block_size(block_previous(heap_tail));
+	info.maxfree = heap_largest_free();
+	info.expansions = heap_totals.expansions;
+	heap_release();
+	return info;
+}
+
+/**
+ * @brief Creates a pool for objects of the specified size.
+ *
+ * Objects are allocated from slabs, which are taken from the heap as needed
+ * and track their free objects in a bitmap, so allocating and freeing an
+ * object does not fragment the heap.
+ *
+ * @param size The size of the objects.
+ * @return A pointer to the new pool, or NULL if the allocation fails.
+ */
+pool_t *pool_create(size_t size)
+{
+	pool_t *pool;
+
+	if (size > SIZE_MAX / (4 * HEAP_SLAB_OBJECTS) ||
+	    !(pool = malloc(sizeof(pool_t))))
+		return NULL;
+	pool_setup(pool, heap_request_size(size));
+	return pool;
+}
+
+/**
+ * @brief Allocates an object from a pool.
+ *
+ * @param pool Pointer to the pool.
+ * @return A pointer to the allocated object, or NULL if the allocation fails.
+ */
+void *pool_alloc(pool_t *pool)
+{
+	heap_block *object;
+
+	heap_acquire();
+	object = pool_take(pool);
+	heap_release();
+
+	if (!object)
+		return NULL;
+	heap_debug_arm((uint8_t *)object + sizeof(heap_block),
+		       pool->size - HEAP_DEBUG_TAIL);
+	return (uint8_t *)object + sizeof(heap_block);
+}
+
+/**
+ * @brief Returns an object to the pool it was allocated from.
+ *
+ * @param pool Pointer to the pool.
+ * @param ptr Pointer to the object to free.
+ */
+void pool_free(pool_t *pool, void *ptr)
+{
+	heap_block *object =
+		(heap_block *)((uintptr_t)ptr - sizeof(heap_block));
+
+	if (!ptr || object_slab(object)->pool != pool)
+		return;
+
+	heap_acquire();
+	if (heap_debug_verify(object, true))
+		pool_put(object);
+	heap_release();
+}
+
+/**
+ * @brief Destroys a pool and frees all objects allocated from it.
+ *
+ * @param pool Pointer to the pool.
+ */
+void pool_destroy(pool_t *pool)
+{
+	heap_slab *slab;
+
+	heap_acquire();
+	while ((slab = pool->partial)) {
+		slab_unlink(&pool->partial, slab);
+		do_free((heap_block *)((uintptr_t)slab - sizeof(heap_block)));
+	}
+	while ((slab = pool->full)) {
+		slab_unlink(&pool->full, slab);
+		do_free((heap_block *)((uintptr_t)slab - sizeof(heap_block)));
+	}
+	heap_auto_trim();
+	heap_release();
+	free(pool);
 }
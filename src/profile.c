@@ -0,0 +1,339 @@
+/**
+ * @file profile.c
+ * @brief Sampling heap profiler.
+ *
+ * This file contains the heap profiler. While it runs, the allocator records
+ * the call stack of one allocation every interval bytes. Samples are
+ * aggregated per call stack, and the samples that are still allocated are
+ * tracked so that the profile also shows which call stacks hold memory.
+ */
+
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Both tables use open addressing with linear probing. Samples that do not
+ * fit are counted as dropped. The tables share one mapping, which is made
+ * when the profiler is first started.
+ */
+#define PROFILE_SITES 256
+#define PROFILE_LIVE 4096
+#define PROFILE_PAGE_SIZE 0x1000
+#define PROFILE_TABLES_SIZE                                           \
+	((sizeof(heap_profile_site_t) * PROFILE_SITES +                 \
+	  sizeof(profile_live) * PROFILE_LIVE + PROFILE_PAGE_SIZE - 1) & \
+	 ~(size_t)(PROFILE_PAGE_SIZE - 1))
+
+/*
+ * Call stacks are followed through the saved frame pointers, starting from
+ * the frame of the allocator entry point, so that only the callers of the
+ * allocator are recorded. c_core is built with frame pointers, but the
+ * program may not be, so frames more than PROFILE_MAX_FRAME bytes apart end
+ * the walk, as does the frame set up by crt0 with a null frame pointer.
+ */
+#define PROFILE_MAX_FRAME 0x100000
+
+typedef struct _profile_live profile_live;
+struct _profile_live {
+	void *ptr;
+	size_t size;
+	size_t site;
+};
+
+atomic_size_t _profile_interval;
+atomic_size_t _profile_live_count;
+
+static heap_profile_site_t *profile_sites;
+static profile_live *profile_samples;
+static size_t profile_dropped;
+
+static atomic_flag profile_lock = ATOMIC_FLAG_INIT;
+
+void *_map_pages(size_t size);
+
+/**
+ * @brief Acquires the profiler lock.
+ */
+static void profile_acquire(void)
+{
+	while (atomic_flag_test_and_set_explicit(&profile_lock,
+						 memory_order_acquire))
+		;
+}
+
+/**
+ * @brief Releases the profiler lock.
+ */
+static void profile_release(void)
+{
+	atomic_flag_clear_explicit(&profile_lock, memory_order_release);
+}
+
+/**
+ * @brief Records the return addresses of the frames above a frame.
+ *
+ * @param frames Array that receives the return addresses.
+ * @param start The frame whose return address is recorded first.
+ * @return The number of return addresses recorded.
+ */
+static size_t profile_backtrace(void **frames, void *start)
+{
+	uintptr_t *frame = start;
+	uintptr_t *next;
+	size_t depth = 0;
+
+	while (frame && depth < HEAP_PROFILE_DEPTH) {
+		if (!frame[1])
+			break;
+		frames[depth++] = (void *)frame[1];
+		next = (uintptr_t *)frame[0];
+		if (next <= frame ||
+		    (uintptr_t)next - (uintptr_t)frame > PROFILE_MAX_FRAME)
+			break;
+		frame = next;
+	}
+	return depth;
+}
+
+/**
+ * @brief Hashes a pointer or a call stack for the profiler tables.
+ *
+ * @param words The words to hash.
+ * @param count The number of words.
+ * @return The hash.
+ */
+static size_t profile_hash(void *const *words, size_t count)
+{
+	uint64_t hash = 0;
+
+	for (size_t i = 0; i < count; i++)
+		hash = (hash ^ (uintptr_t)words[i]) * 0x9e3779b97f4a7c15ull;
+	return hash ^ hash >> 29;
+}
+
+/**
+ * @brief Finds the site of a call stack, adding it if it is new. The
+ * profiler lock must be held.
+ *
+ * @param frames The return addresses of the call stack.
+ * @param depth The number of return addresses.
+ * @return The index of the site, or PROFILE_SITES if the table is full.
+ */
+static size_t profile_find_site(void *const *frames, size_t depth)
+{
+	size_t index = profile_hash(frames, depth) % PROFILE_SITES;
+	heap_profile_site_t *site;
+	size_t i;
+
+	for (size_t n = 0; n < PROFILE_SITES; n++) {
+		site = &profile_sites[index];
+		if (!site->samples) {
+			site->depth = depth;
+			for (i = 0; i < depth; i++)
+				site->frames[i] = frames[i];
+			return index;
+		}
+		if (site->depth == depth) {
+			for (i = 0; i < depth; i++)
+				if (site->frames[i] != frames[i])
+					break;
+			if (i == depth)
+				return index;
+		}
+		index = (index + 1) % PROFILE_SITES;
+	}
+	return PROFILE_SITES;
+}
+
+/**
+ * @brief Records a sampled allocation.
+ *
+ * @param ptr Pointer to the allocated memory.
+ * @param size The size of the allocation.
+ * @param frame The frame of the allocator function called by the program.
+ */
+void _profile_sample(void *ptr, size_t size, void *frame)
+{
+	void *frames[HEAP_PROFILE_DEPTH];
+	size_t depth = profile_backtrace(frames, frame);
+	size_t site;
+	size_t index;
+
+	profile_acquire();
+	if (!profile_sites) {
+		profile_release();
+		return;
+	}
+	site = profile_find_site(frames, depth);
+	if (site == PROFILE_SITES) {
+		profile_dropped++;
+		profile_release();
+		return;
+	}
+	profile_sites[site].samples++;
+	profile_sites[site].bytes += size;
+
+	if (atomic_load_explicit(&_profile_live_count, memory_order_relaxed) ==
+	    PROFILE_LIVE) {
+		profile_dropped++;
+		profile_release();
+		return;
+	}
+	index = profile_hash(&ptr, 1) % PROFILE_LIVE;
+	while (profile_samples[index].ptr)
+		index = (index + 1) % PROFILE_LIVE;
+	profile_samples[index].ptr = ptr;
+	profile_samples[index].size = size;
+	profile_samples[index].site = site;
+	profile_sites[site].live_samples++;
+	profile_sites[site].live_bytes += size;
+	atomic_fetch_add_explicit(&_profile_live_count, 1,
+				  memory_order_relaxed);
+	profile_release();
+}
+
+/**
+ * @brief Removes a sampled allocation that is being freed.
+ *
+ * Entries after the removed one are moved back so that no probe sequence
+ * is broken. This is only called while samples are tracked, so the tables
+ * have been mapped.
+ *
+ * @param ptr Pointer to the memory being freed.
+ */
+void _profile_forget(void *ptr)
+{
+	size_t index = profile_hash(&ptr, 1) % PROFILE_LIVE;
+	size_t next;
+	size_t home;
+	profile_live *sample;
+
+	profile_acquire();
+	while (profile_samples[index].ptr != ptr) {
+		if (!profile_samples[index].ptr) {
+			profile_release();
+			return;
+		}
+		index = (index + 1) % PROFILE_LIVE;
+	}
+
+	sample = &profile_samples[index];
+	profile_sites[sample->site].live_samples--;
+	profile_sites[sample->site].live_bytes -= sample->size;
+	atomic_fetch_sub_explicit(&_profile_live_count, 1,
+				  memory_order_relaxed);
+
+	next = index;
+	while (true) {
+		next = (next + 1) % PROFILE_LIVE;
+		if (!profile_samples[next].ptr)
+			break;
+		home = profile_hash(&profile_samples[next].ptr, 1) %
+		       PROFILE_LIVE;
+		if ((next - home) % PROFILE_LIVE <
+		    (next - index) % PROFILE_LIVE)
+			continue;
+		profile_samples[index] = profile_samples[next];
+		index = next;
+	}
+	profile_samples[index].ptr = NULL;
+	profile_release();
+}
+
+/**
+ * @brief Starts sampling allocations.
+ *
+ * The tables of the profile are mapped the first time the profiler starts.
+ * If they cannot be mapped, the profiler stays off.
+ *
+ * @param interval Average number of bytes allocated between two samples.
+ */
+void heap_profile_start(size_t interval)
+{
+	void *tables;
+
+	profile_acquire();
+	if (!profile_sites) {
+		if (!(tables = _map_pages(PROFILE_TABLES_SIZE))) {
+			profile_release();
+			return;
+		}
+		profile_sites = tables;
+		profile_samples = (profile_live *)(profile_sites +
+						   PROFILE_SITES);
+	}
+	profile_release();
+	atomic_store_explicit(&_profile_interval, interval ? interval : 1,
+			      memory_order_relaxed);
+}
+
+/**
+ * @brief Stops sampling allocations.
+ *
+ * The profile is kept, and samples are still removed when they are freed.
+ */
+void heap_profile_stop(void)
+{
+	atomic_store_explicit(&_profile_interval, 0, memory_order_relaxed);
+}
+
+/**
+ * @brief Clears the samples of all call stacks.
+ *
+ * Allocations sampled before the reset are no longer tracked.
+ */
+void heap_profile_reset(void)
+{
+	profile_acquire();
+	if (!profile_sites) {
+		profile_release();
+		return;
+	}
+	for (size_t i = 0; i < PROFILE_SITES; i++)
+		profile_sites[i] = (heap_profile_site_t){ 0 };
+	for (size_t i = 0; i < PROFILE_LIVE; i++)
+		profile_samples[i].ptr = NULL;
+	profile_dropped = 0;
+	atomic_store_explicit(&_profile_live_count, 0, memory_order_relaxed);
+	profile_release();
+}
+
+/**
+ * @brief Reports the profile, one call stack at a time.
+ *
+ * The callback is called without holding any lock, so it may allocate.
+ *
+ * @param callback Function called with every call stack that was sampled.
+ * @param arg Argument passed to the callback.
+ * @return The number of samples dropped because a table was full.
+ */
+size_t heap_profile_dump(void (*callback)(const heap_profile_site_t *site,
+					  void *arg),
+			 void *arg)
+{
+	heap_profile_site_t site;
+	size_t dropped;
+
+	profile_acquire();
+	if (!profile_sites) {
+		profile_release();
+		return 0;
+	}
+	profile_release();
+
+	for (size_t i = 0; i < PROFILE_SITES; i++) {
+		profile_acquire();
+		site = profile_sites[i];
+		profile_release();
+		if (site.samples)
+			callback(&site, arg);
+	}
+
+	profile_acquire();
+	dropped = profile_dropped;
+	profile_release();
+	return dropped;
+}
@@ -0,0 +1,204 @@
+/**
+ * @file trace.c
+ * @brief Allocation tracing.
+ *
+ * This file contains the allocation tracer. While it runs, every call to the
+ * allocator is logged to a ring buffer together with a time stamp, so that
+ * the allocation pattern of a program can be saved and replayed later.
+ */
+
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The ring buffer holds the last TRACE_EVENTS events. Events that are
+ * overwritten before they are dumped are counted as lost. The ring is mapped
+ * when tracing is first started, so programs that never trace do not carry
+ * it.
+ */
+#define TRACE_EVENTS 8192
+#define TRACE_PAGE_SIZE 0x1000
+#define TRACE_RING_SIZE                                            \
+	((sizeof(trace_slot) * TRACE_EVENTS + TRACE_PAGE_SIZE - 1) & \
+	 ~(size_t)(TRACE_PAGE_SIZE - 1))
+
+/*
+ * Writers claim a slot by incrementing the head of the ring, then publish
+ * the event by storing its position plus one in the sequence number of the
+ * slot. The sequence number is cleared while the event is written, so that
+ * a reader can tell a complete event from one that is being overwritten.
+ */
+typedef struct _trace_slot trace_slot;
+struct _trace_slot {
+	atomic_size_t sequence;
+	heap_trace_event_t event;
+};
+
+atomic_bool _trace_enabled;
+
+static trace_slot *_Atomic trace_ring;
+static atomic_size_t trace_head;
+static size_t trace_tail;
+
+static atomic_flag trace_lock = ATOMIC_FLAG_INIT;
+
+void *_map_pages(size_t size);
+
+/**
+ * @brief Acquires the tracer lock.
+ */
+static void trace_acquire(void)
+{
+	while (atomic_flag_test_and_set_explicit(&trace_lock,
+						 memory_order_acquire))
+		;
+}
+
+/**
+ * @brief Releases the tracer lock.
+ */
+static void trace_release(void)
+{
+	atomic_flag_clear_explicit(&trace_lock, memory_order_release);
+}
+
+/**
+ * @brief Reads the time stamp counter.
+ *
+ * @return The current value of the time stamp counter.
+ */
+static unsigned long long trace_clock(void)
+{
+#ifdef __x86_64__
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/**
+ * @brief Logs a call to the allocator.
+ *
+ * @param op The operation, one of the HEAP_TRACE_* values.
+ * @param size The size that was requested.
+ * @param ptr The pointer that was returned or freed.
+ * @param old The pointer passed to realloc().
+ * @param alignment The alignment that was requested.
+ */
+void _trace_record(int op, size_t size, void *ptr, void *old,
+		   size_t alignment)
+{
+	trace_slot *ring = atomic_load_explicit(&trace_ring,
+						memory_order_acquire);
+	size_t index;
+	trace_slot *slot;
+
+	if (!ring)
+		return;
+	index = atomic_fetch_add_explicit(&trace_head, 1,
+					  memory_order_relaxed);
+	slot = &ring[index % TRACE_EVENTS];
+	atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	slot->event = (heap_trace_event_t){
+		.time = trace_clock(),
+		.op = op,
+		.size = size,
+		.ptr = ptr,
+		.old = old,
+		.alignment = alignment,
+	};
+	atomic_store_explicit(&slot->sequence, index + 1,
+			      memory_order_release);
+}
+
+/**
+ * @brief Starts logging calls to the allocator.
+ *
+ * The ring buffer is mapped the first time tracing starts. If it cannot be
+ * mapped, tracing stays off.
+ */
+void heap_trace_start(void)
+{
+	trace_slot *ring;
+
+	trace_acquire();
+	if (!atomic_load_explicit(&trace_ring, memory_order_relaxed)) {
+		if (!(ring = _map_pages(TRACE_RING_SIZE))) {
+			trace_release();
+			return;
+		}
+		atomic_store_explicit(&trace_ring, ring, memory_order_release);
+	}
+	trace_release();
+	atomic_store_explicit(&_trace_enabled, true, memory_order_relaxed);
+}
+
+/**
+ * @brief Stops logging calls to the allocator.
+ *
+ * Events that were logged are kept until they are dumped.
+ */
+void heap_trace_stop(void)
+{
+	atomic_store_explicit(&_trace_enabled, false, memory_order_relaxed);
+}
+
+/**
+ * @brief Reports the events logged since the last dump, oldest first.
+ *
+ * Logging does not take any lock, so the callback may allocate, and the
+ * events it causes are reported by the next dump. An event that is still
+ * being written ends the dump and is reported by the next one. A slot that
+ * holds any other event than the expected one was overwritten, either by a
+ * newer event or by a writer that fell a whole ring behind, and is counted as
+ * lost.
+ *
+ * @param callback Function called with every event.
+ * @param arg Argument passed to the callback.
+ * @return The number of events lost because they were overwritten.
+ */
+size_t heap_trace_dump(void (*callback)(const heap_trace_event_t *event,
+					void *arg),
+		       void *arg)
+{
+	size_t head;
+	size_t lost = 0;
+	size_t sequence;
+	heap_trace_event_t event;
+	trace_slot *ring;
+	trace_slot *slot;
+
+	trace_acquire();
+	if (!(ring = atomic_load_explicit(&trace_ring, memory_order_acquire))) {
+		trace_release();
+		return 0;
+	}
+	head = atomic_load_explicit(&trace_head, memory_order_acquire);
+	if (head - trace_tail > TRACE_EVENTS) {
+		lost = head - TRACE_EVENTS - trace_tail;
+		trace_tail = head - TRACE_EVENTS;
+	}
+
+	for (; trace_tail != head; trace_tail++) {
+		slot = &ring[trace_tail % TRACE_EVENTS];
+		sequence = atomic_load_explicit(&slot->sequence,
+						memory_order_acquire);
+		if (!sequence)
+			break;
+		event = slot->event;
+		atomic_thread_fence(memory_order_acquire);
+		if (sequence != trace_tail + 1 ||
+		    atomic_load_explicit(&slot->sequence,
+					 memory_order_relaxed) != sequence) {
+			lost++;
+			continue;
+		}
+		callback(&event, arg);
+	}
+	trace_release();
+	return lost;
+}
@@ -0,0 +1,445 @@
+/**
+ * @file heap_test.c
+ * @brief Randomized allocator tests for a Linux host.
+ *
+ * This program makes random calls to the allocation functions of c_core,
+ * first from one thread and then from several threads at once that also
+ * free blocks allocated by each other. Every block is filled with a pattern
+ * that is checked before the block is resized or freed, and the heap is
+ * checked with heap_check() along the way. The test is built with the heap
+ * options of c_core, so a heap configuration is tested by building c_core
+ * with its options and running the test.
+ */
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_THREADS 4
+#define TEST_SLOTS 512
+#define TEST_OPS 100000
+#define TEST_THREAD_OPS 50000
+#define TEST_CHECK_INTERVAL 4096
+#define TEST_BATCH 16
+#define TEST_HANDOFF 64
+
+/*
+ * How a block was allocated decides how it may be freed: free_sized() only
+ * takes blocks from malloc(), calloc() and realloc(), and
+ * free_aligned_sized() only takes blocks from aligned_alloc().
+ */
+#define TEST_MALLOC 0
+#define TEST_ALIGNED 1
+#define TEST_MEMALIGN 2
+
+typedef struct _test_block test_block;
+struct _test_block {
+	unsigned char *ptr;
+	size_t size;
+	size_t alignment;
+	int kind;
+	unsigned char seed;
+};
+
+typedef struct _test_thread test_thread;
+struct _test_thread {
+	uint64_t seed;
+	test_block slots[TEST_SLOTS];
+};
+
+static test_thread test_threads[TEST_THREADS];
+static unsigned char *_Atomic test_handoff[TEST_HANDOFF];
+
+static atomic_int test_failures;
+static const char *_Atomic test_heap_message;
+
+/**
+ * @brief Reports a failed check.
+ *
+ * @param message What went wrong.
+ * @param ptr The pointer that was checked.
+ */
+static void test_fail(const char *message, void *ptr)
+{
+	if (atomic_fetch_add(&test_failures, 1) < 10)
+		fprintf(stderr, "heap_test: %s (%p)\n", message, ptr);
+}
+
+/**
+ * @brief Records an error found by the heap in debug mode.
+ *
+ * This is called with the heap locked, so it only records the message.
+ *
+ * @param message The error.
+ * @param ptr The pointer that was passed to the allocator.
+ */
+static void test_heap_error(const char *message, void *ptr)
+{
+	(void)ptr;
+	atomic_store(&test_heap_message, message);
+	atomic_fetch_add(&test_failures, 1);
+}
+
+/**
+ * @brief Returns the next number of the random sequence of a thread.
+ *
+ * @param thread The thread.
+ * @return A random number.
+ */
+static uint64_t test_random(test_thread *thread)
+{
+	thread->seed ^= thread->seed >> 12;
+	thread->seed ^= thread->seed << 25;
+	thread->seed ^= thread->seed >> 27;
+	return thread->seed * 0x2545f4914f6cdd1dull;
+}
+
+/**
+ * @brief Picks the size of an allocation.
+ *
+ * Most allocations are small, some are too large for the pools, and a few
+ * are large enough to be mapped directly.
+ *
+ * @param thread The thread.
+ * @return The size in bytes.
+ */
+static size_t test_size(test_thread *thread)
+{
+	uint64_t choice = test_random(thread) % 100;
+	uint64_t random = test_random(thread);
+
+	if (choice < 70)
+		return 1 + random % 256;
+	if (choice < 95)
+		return 257 + random % 8192;
+	if (choice < 99)
+		return 8449 + random % 65536;
+	return 0x40000 + random % 0x60000;
+}
+
+/**
+ * @brief Fills a block with its pattern.
+ *
+ * @param ptr Pointer to the block.
+ * @param size The size of the block.
+ * @param seed The first byte of the pattern.
+ */
+static void test_fill(unsigned char *ptr, size_t size, unsigned char seed)
+{
+	for (size_t i = 0; i < size; i++)
+		ptr[i] = seed + i;
+}
+
+/**
+ * @brief Checks that a block still holds its pattern.
+ *
+ * @param ptr Pointer to the block.
+ * @param size The number of bytes to check.
+ * @param seed The first byte of the pattern.
+ * @return true if the pattern is intact, false otherwise.
+ */
+static bool test_intact(const unsigned char *ptr, size_t size,
+			unsigned char seed)
+{
+	for (size_t i = 0; i < size; i++)
+		if (ptr[i] != (unsigned char)(seed + i))
+			return false;
+	return true;
+}
+
+/**
+ * @brief Allocates a block for an empty slot with a random function.
+ *
+ * @param thread The thread.
+ * @param block The slot.
+ */
+static void test_allocate(test_thread *thread, test_block *block)
+{
+	size_t size = test_size(thread);
+	size_t alignment = (size_t)16 << test_random(thread) % 9;
+	void *ptr = NULL;
+	int kind = TEST_MALLOC;
+
+	switch (test_random(thread) % 6) {
+	case 0:
+	case 1:
+		ptr = malloc(size);
+		alignment = 16;
+		break;
+	case 2:
+		ptr = calloc(1 + size / 8, 8);
+		size = (1 + size / 8) * 8;
+		alignment = 16;
+		for (size_t i = 0; ptr && i < size; i++)
+			if (((unsigned char *)ptr)[i]) {
+				test_fail("calloc returned dirty memory", ptr);
+				break;
+			}
+		break;
+	case 3:
+		ptr = aligned_alloc(alignment, size);
+		kind = TEST_ALIGNED;
+		break;
+	case 4:
+		if (posix_memalign(&ptr, alignment, size))
+			ptr = NULL;
+		kind = TEST_MEMALIGN;
+		break;
+	case 5:
+		ptr = memalign(alignment, size);
+		kind = TEST_MEMALIGN;
+		break;
+	}
+
+	if (!ptr) {
+		test_fail("allocation failed", NULL);
+		return;
+	}
+	if ((uintptr_t)ptr % alignment)
+		test_fail("allocation is not aligned", ptr);
+	if (malloc_usable_size(ptr) < size)
+		test_fail("usable size is too small", ptr);
+	*block = (test_block){
+		.ptr = ptr,
+		.size = size,
+		.alignment = alignment,
+		.kind = kind,
+		.seed = test_random(thread),
+	};
+	test_fill(block->ptr, size, block->seed);
+}
+
+/**
+ * @brief Frees the block of a slot with a random function.
+ *
+ * @param thread The thread.
+ * @param block The slot.
+ */
+static void test_release(test_thread *thread, test_block *block)
+{
+	if (!test_intact(block->ptr, block->size, block->seed))
+		test_fail("block was overwritten", block->ptr);
+
+	if (test_random(thread) % 2)
+		free(block->ptr);
+	else if (block->kind == TEST_MALLOC)
+		free_sized(block->ptr, block->size);
+	else if (block->kind == TEST_ALIGNED)
+		free_aligned_sized(block->ptr, block->alignment, block->size);
+	else
+		free(block->ptr);
+	block->ptr = NULL;
+}
+
+/**
+ * @brief Resizes the block of a slot with realloc().
+ *
+ * @param thread The thread.
+ * @param block The slot.
+ */
+static void test_resize(test_thread *thread, test_block *block)
+{
+	size_t size = test_size(thread);
+	size_t kept = size < block->size ? size : block->size;
+	unsigned char *ptr;
+
+	if (!test_intact(block->ptr, block->size, block->seed))
+		test_fail("block was overwritten", block->ptr);
+	if (!(ptr = realloc(block->ptr, size))) {
+		test_fail("realloc failed", block->ptr);
+		return;
+	}
+	if (!test_intact(ptr, kept, block->seed))
+		test_fail("realloc lost the contents", ptr);
+	if ((uintptr_t)ptr % 16 || malloc_usable_size(ptr) < size)
+		test_fail("realloc returned a bad block", ptr);
+	block->ptr = ptr;
+	block->size = size;
+	block->alignment = 16;
+	block->kind = TEST_MALLOC;
+	test_fill(ptr, size, block->seed);
+}
+
+/**
+ * @brief Allocates a batch of blocks with malloc_batch() and frees them
+ * with free_batch().
+ *
+ * @param thread The thread.
+ */
+static void test_batch(test_thread *thread)
+{
+	void *ptrs[TEST_BATCH];
+	size_t size = test_size(thread);
+	size_t count = malloc_batch(size, TEST_BATCH, ptrs);
+
+	if (!count)
+		test_fail("malloc_batch failed", NULL);
+	for (size_t i = 0; i < count; i++)
+		test_fill(ptrs[i], size, i);
+	for (size_t i = 0; i < count; i++)
+		if (!test_intact(ptrs[i], size, i) || (uintptr_t)ptrs[i] % 16)
+			test_fail("batch block was overwritten", ptrs[i]);
+	free_batch(ptrs, count);
+}
+
+/**
+ * @brief Swaps a block with one left by another thread, and frees the one
+ * that was left.
+ *
+ * Handed off blocks start with their size, followed by a pattern that
+ * starts with the low byte of the size.
+ *
+ * @param thread The thread.
+ */
+static void test_handoff_swap(test_thread *thread)
+{
+	size_t size = sizeof(size_t) + test_size(thread);
+	unsigned char *ptr = malloc(size);
+	size_t left_size;
+	unsigned char *left;
+
+	if (!ptr) {
+		test_fail("allocation failed", NULL);
+		return;
+	}
+	memcpy(ptr, &size, sizeof(size));
+	test_fill(ptr + sizeof(size), size - sizeof(size), size);
+
+	left = atomic_exchange(
+		&test_handoff[test_random(thread) % TEST_HANDOFF], ptr);
+	if (!left)
+		return;
+	memcpy(&left_size, left, sizeof(left_size));
+	if (!test_intact(left + sizeof(left_size),
+			 left_size - sizeof(left_size), left_size))
+		test_fail("handed off block was overwritten", left);
+	free_sized(left, left_size);
+}
+
+/**
+ * @brief Runs random operations on the slots of a thread.
+ *
+ * @param thread The thread.
+ * @param ops The number of operations.
+ * @param handoff Whether blocks are also handed off to other threads.
+ * @param check Whether the heap is checked along the way.
+ */
+static void test_run(test_thread *thread, size_t ops, bool handoff,
+		     bool check)
+{
+	test_block *block;
+
+	for (size_t op = 0; op < ops; op++) {
+		block = &thread->slots[test_random(thread) % TEST_SLOTS];
+		if (!block->ptr)
+			test_allocate(thread, block);
+		else if (test_random(thread) % 4)
+			test_release(thread, block);
+		else
+			test_resize(thread, block);
+
+		if (op % 64 == 0)
+			test_batch(thread);
+		if (handoff && op % 8 == 0)
+			test_handoff_swap(thread);
+		if (check && op % TEST_CHECK_INTERVAL == 0 && heap_check())
+			test_fail("heap_check failed", NULL);
+	}
+}
+
+/**
+ * @brief Frees every block left in the slots of a thread.
+ *
+ * @param thread The thread.
+ */
+static void test_drain(test_thread *thread)
+{
+	for (size_t i = 0; i < TEST_SLOTS; i++)
+		if (thread->slots[i].ptr)
+			test_release(thread, &thread->slots[i]);
+}
+
+/**
+ * @brief Runs one of the threads of the multi-threaded test.
+ *
+ * @param arg The thread.
+ * @return NULL.
+ */
+static void *test_thread_main(void *arg)
+{
+	test_thread *thread = arg;
+
+	test_run(thread, TEST_THREAD_OPS, true, false);
+	test_drain(thread);
+	heap_thread_exit();
+	return NULL;
+}
+
+/**
+ * @brief Checks the heap after a test.
+ *
+ * @param name The name of the test.
+ * @return 0 if the test passed, 1 otherwise.
+ */
+static int test_report(const char *name)
+{
+	const char *message;
+
+	if (heap_check())
+		test_fail("heap_check failed", NULL);
+	if ((message = atomic_exchange(&test_heap_message, NULL)))
+		fprintf(stderr, "heap_test: heap error: %s\n", message);
+	if (atomic_exchange(&test_failures, 0)) {
+		printf("%s: failed\n", name);
+		return 1;
+	}
+	printf("%s: ok\n", name);
+	return 0;
+}
+
+/**
+ * @brief Runs the single-threaded and the multi-threaded test.
+ *
+ * @return 0 if both passed, 1 otherwise.
+ */
+int main(void)
+{
+	pthread_t threads[TEST_THREADS];
+	unsigned char *left;
+	size_t size;
+	int result = 0;
+
+	heap_set_error_handler(test_heap_error);
+
+	test_threads[0].seed = 0x9e3779b97f4a7c15ull;
+	test_run(&test_threads[0], TEST_OPS, false, true);
+	test_drain(&test_threads[0]);
+	result |= test_report("single thread");
+
+	for (size_t i = 0; i < TEST_THREADS; i++) {
+		test_threads[i].seed = 0x9e3779b97f4a7c15ull * (i + 2);
+		if (pthread_create(&threads[i], NULL, test_thread_main,
+				   &test_threads[i])) {
+			fprintf(stderr, "heap_test: cannot create threads\n");
+			return 1;
+		}
+	}
+	for (size_t i = 0; i < TEST_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	for (size_t i = 0; i < TEST_HANDOFF; i++) {
+		if (!(left = atomic_exchange(&test_handoff[i], NULL)))
+			continue;
+		memcpy(&size, left, sizeof(size));
+		if (!test_intact(left + sizeof(size), size - sizeof(size),
+				 size))
+			test_fail("handed off block was overwritten", left);
+		free(left);
+	}
+	result |= test_report("threads");
+	return result;
+}
@@ -0,0 +1,597 @@
+/**
+ * @file heap_bench.c
+ * @brief Allocator benchmarks for a Linux host.
+ *
+ * This program runs a set of allocation workloads and reports, for each of
+ * them, how many calls to the allocator were made per second, how long
+ * single calls took and how much memory was used at the peak. It is built
+ * once against c_core and once against the allocator of the host C library,
+ * so that allocator changes can be compared with each other and with glibc.
+ *
+ * The peak is the largest resident set of the process running the workload,
+ * which counts the memory the allocator kept but did not use, so that both
+ * allocators are measured the same way. Against c_core, the most memory the
+ * heap ever had in use, as reported by mallinfo2(), is shown as well.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef BENCH_GLIBC
+#define BENCH_ALLOCATOR "glibc"
+#else
+#include <malloc.h>
+#define BENCH_ALLOCATOR "c_core"
+#endif
+
+/*
+ * Latencies are counted in a histogram with eight buckets for every power of
+ * two, so percentiles are exact to within an eighth without keeping every
+ * sample. Values below 16 ticks have a bucket each.
+ */
+#define BENCH_BUCKETS (16 + 60 * 8)
+
+#define BENCH_THREADS 4
+#define BENCH_SLOTS 4096
+
+#define BENCH_CHURN 2000000
+#define BENCH_CHURN_SLOTS 256
+#define BENCH_CHURN_SIZE 64
+#define BENCH_RANDOM 1000000
+#define BENCH_TRANSFERS 1000000
+#define BENCH_QUEUE 1024
+#define BENCH_LARSON 100000
+#define BENCH_LARSON_SLOTS 1024
+#define BENCH_GENERATIONS 4
+#define BENCH_FRAG_PHASES 16
+#define BENCH_FRAG_OBJECTS BENCH_SLOTS
+
+/*
+ * Every workload runs in a child process of its own, so it starts with a
+ * fresh heap and zeroed statistics, and the peak memory use of the child
+ * covers that workload and the startup of the program, but no other
+ * workload.
+ */
+typedef struct _bench_thread bench_thread;
+struct _bench_thread {
+	uint64_t histogram[BENCH_BUCKETS];
+	uint64_t ops;
+	uint64_t max;
+	uint64_t seed;
+	void *slots[BENCH_SLOTS];
+};
+
+typedef struct _bench_workload bench_workload;
+struct _bench_workload {
+	const char *name;
+	void (*run)(void);
+};
+
+static bench_thread bench_threads[BENCH_THREADS];
+static void *bench_kept[BENCH_FRAG_PHASES * BENCH_FRAG_OBJECTS / 2];
+static void *_Atomic bench_queue[BENCH_QUEUE];
+static double bench_ticks_per_ns = 1;
+
+/**
+ * @brief Returns the time of a monotonic clock in seconds.
+ *
+ * @return The time in seconds.
+ */
+static double bench_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Reads the clock used to time single calls.
+ *
+ * @return The time stamp counter, or the monotonic clock in nanoseconds
+ * where there is none.
+ */
+static uint64_t bench_ticks(void)
+{
+#ifdef __x86_64__
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Measures how many ticks of bench_ticks() make a nanosecond.
+ *
+ * @return The number of ticks per nanosecond.
+ */
+static double bench_calibrate(void)
+{
+	double start = bench_time();
+	uint64_t ticks = bench_ticks();
+	double elapsed;
+
+	while ((elapsed = bench_time() - start) < 0.05)
+		;
+	return (bench_ticks() - ticks) / (elapsed * 1e9);
+}
+
+/**
+ * @brief Returns the next number of the random sequence of a thread.
+ *
+ * @param thread The thread.
+ * @return A random number.
+ */
+static uint64_t bench_random(bench_thread *thread)
+{
+	thread->seed ^= thread->seed >> 12;
+	thread->seed ^= thread->seed << 25;
+	thread->seed ^= thread->seed >> 27;
+	return thread->seed * 0x2545f4914f6cdd1dull;
+}
+
+/**
+ * @brief Returns a random allocation size.
+ *
+ * Sizes are spread evenly over powers of two, so small sizes are as common
+ * as they are in most programs.
+ *
+ * @param thread The thread.
+ * @param classes The number of powers of two above 16 to choose from.
+ * @return A size between 1 and 16 << (classes - 1).
+ */
+static size_t bench_size(bench_thread *thread, unsigned classes)
+{
+	uint64_t random = bench_random(thread);
+
+	return (random >> 8) % ((size_t)16 << random % classes) + 1;
+}
+
+/**
+ * @brief Returns the histogram bucket of a latency.
+ *
+ * @param ticks The latency in ticks.
+ * @return The index of the bucket.
+ */
+static size_t bench_bucket(uint64_t ticks)
+{
+	int shift;
+
+	if (ticks < 16)
+		return ticks;
+	shift = 60 - __builtin_clzll(ticks);
+	return 16 + (shift - 1) * 8 + (ticks >> shift & 7);
+}
+
+/**
+ * @brief Returns the largest latency counted in a histogram bucket.
+ *
+ * @param bucket The index of the bucket.
+ * @return The latency in ticks.
+ */
+static uint64_t bench_bucket_limit(size_t bucket)
+{
+	int shift;
+
+	if (bucket < 16)
+		return bucket;
+	shift = (bucket - 16) / 8 + 1;
+	return ((8 + (bucket - 16) % 8 + 1) << shift) - 1;
+}
+
+/**
+ * @brief Counts a call to the allocator.
+ *
+ * @param thread The thread that made the call.
+ * @param ticks How long the call took.
+ */
+static void bench_record(bench_thread *thread, uint64_t ticks)
+{
+	thread->histogram[bench_bucket(ticks)]++;
+	if (ticks > thread->max)
+		thread->max = ticks;
+	thread->ops++;
+}
+
+/**
+ * @brief Allocates memory and counts the call.
+ *
+ * The first byte is written, as a program would, after the call is timed.
+ * The benchmark ends if the allocator runs out of memory.
+ *
+ * @param thread The thread that makes the call.
+ * @param size The size to allocate.
+ * @return Pointer to the allocated memory.
+ */
+static void *bench_malloc(bench_thread *thread, size_t size)
+{
+	uint64_t start = bench_ticks();
+	void *ptr = malloc(size);
+
+	bench_record(thread, bench_ticks() - start);
+	if (!ptr) {
+		fprintf(stderr, "out of memory\n");
+		_exit(1);
+	}
+	*(volatile char *)ptr = 0;
+	return ptr;
+}
+
+/**
+ * @brief Frees memory and counts the call.
+ *
+ * @param thread The thread that makes the call.
+ * @param ptr Pointer to the memory to free.
+ */
+static void bench_free(bench_thread *thread, void *ptr)
+{
+	uint64_t start = bench_ticks();
+
+	free(ptr);
+	bench_record(thread, bench_ticks() - start);
+}
+
+/**
+ * @brief Releases the heap state of a thread that is about to exit.
+ */
+static void bench_thread_exit(void)
+{
+#ifndef BENCH_GLIBC
+	heap_thread_exit();
+#endif
+}
+
+/**
+ * @brief Runs a function in several threads and waits for them.
+ *
+ * @param count The number of threads, at most BENCH_THREADS.
+ * @param start The function, which is passed the bench_thread to use.
+ */
+static void bench_spawn(size_t count, void *(*start)(void *))
+{
+	pthread_t threads[BENCH_THREADS];
+
+	for (size_t i = 0; i < count; i++) {
+		if (pthread_create(&threads[i], NULL, start,
+				   &bench_threads[i])) {
+			fprintf(stderr, "cannot create threads\n");
+			_exit(1);
+		}
+	}
+	for (size_t i = 0; i < count; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/**
+ * @brief Frees and reallocates objects of one size in a small set.
+ */
+static void bench_churn(void)
+{
+	bench_thread *thread = &bench_threads[0];
+	size_t slot;
+
+	for (slot = 0; slot < BENCH_CHURN_SLOTS; slot++)
+		thread->slots[slot] = bench_malloc(thread, BENCH_CHURN_SIZE);
+	for (size_t i = 0; i < BENCH_CHURN; i++) {
+		slot = i % BENCH_CHURN_SLOTS;
+		bench_free(thread, thread->slots[slot]);
+		thread->slots[slot] = bench_malloc(thread, BENCH_CHURN_SIZE);
+	}
+	for (slot = 0; slot < BENCH_CHURN_SLOTS; slot++)
+		bench_free(thread, thread->slots[slot]);
+}
+
+/**
+ * @brief Replaces random objects with objects of random sizes.
+ */
+static void bench_random_sizes(void)
+{
+	bench_thread *thread = &bench_threads[0];
+	size_t slot;
+
+	for (slot = 0; slot < BENCH_SLOTS; slot++)
+		thread->slots[slot] = bench_malloc(thread,
+						   bench_size(thread, 10));
+	for (size_t i = 0; i < BENCH_RANDOM; i++) {
+		slot = bench_random(thread) % BENCH_SLOTS;
+		bench_free(thread, thread->slots[slot]);
+		thread->slots[slot] = bench_malloc(thread,
+						   bench_size(thread, 10));
+	}
+	for (slot = 0; slot < BENCH_SLOTS; slot++)
+		bench_free(thread, thread->slots[slot]);
+}
+
+/**
+ * @brief Passes objects from the first thread to the second through a ring.
+ *
+ * The first thread allocates every object and the second frees it, so
+ * every free is made by a thread other than the one that allocated.
+ *
+ * @param arg The bench_thread of the thread.
+ * @return NULL.
+ */
+static void *bench_transfer(void *arg)
+{
+	bench_thread *thread = arg;
+	void *_Atomic *entry;
+	void *ptr;
+
+	for (size_t i = 0; i < BENCH_TRANSFERS; i++) {
+		entry = &bench_queue[i % BENCH_QUEUE];
+		if (thread == &bench_threads[0]) {
+			ptr = bench_malloc(thread, bench_size(thread, 7));
+			while (atomic_load_explicit(entry,
+						    memory_order_acquire))
+				sched_yield();
+			atomic_store_explicit(entry, ptr,
+					      memory_order_release);
+		} else {
+			while (!(ptr = atomic_load_explicit(
+					 entry, memory_order_acquire)))
+				sched_yield();
+			atomic_store_explicit(entry, NULL,
+					      memory_order_relaxed);
+			bench_free(thread, ptr);
+		}
+	}
+	bench_thread_exit();
+	return NULL;
+}
+
+/**
+ * @brief Runs a producer and a consumer thread.
+ */
+static void bench_producer_consumer(void)
+{
+	bench_spawn(2, bench_transfer);
+}
+
+/**
+ * @brief Replaces random objects in the set of a thread.
+ *
+ * The set was allocated by an earlier generation of threads, so the first
+ * frees of every thread are made for memory allocated elsewhere.
+ *
+ * @param arg The bench_thread of the thread.
+ * @return NULL.
+ */
+static void *bench_larson_round(void *arg)
+{
+	bench_thread *thread = arg;
+	size_t slot;
+
+	for (size_t i = 0; i < BENCH_LARSON; i++) {
+		slot = bench_random(thread) % BENCH_LARSON_SLOTS;
+		bench_free(thread, thread->slots[slot]);
+		thread->slots[slot] = bench_malloc(thread,
+						   bench_size(thread, 7));
+	}
+	bench_thread_exit();
+	return NULL;
+}
+
+/**
+ * @brief Runs generations of threads that take over the objects of the
+ * threads before them, as in the benchmark of Larson and Krishnan.
+ */
+static void bench_larson(void)
+{
+	bench_thread *thread;
+
+	for (size_t i = 0; i < BENCH_THREADS; i++) {
+		thread = &bench_threads[i];
+		for (size_t slot = 0; slot < BENCH_LARSON_SLOTS; slot++)
+			thread->slots[slot] =
+				bench_malloc(thread, bench_size(thread, 7));
+	}
+	for (size_t i = 0; i < BENCH_GENERATIONS; i++)
+		bench_spawn(BENCH_THREADS, bench_larson_round);
+	for (size_t i = 0; i < BENCH_THREADS; i++) {
+		thread = &bench_threads[i];
+		for (size_t slot = 0; slot < BENCH_LARSON_SLOTS; slot++)
+			bench_free(thread, thread->slots[slot]);
+	}
+}
+
+/**
+ * @brief Allocates objects of growing sizes and frees every other one.
+ *
+ * The holes left behind are too small for the objects allocated after them,
+ * so the peak memory use shows how well the allocator copes with
+ * fragmentation.
+ */
+static void bench_fragmentation(void)
+{
+	bench_thread *thread = &bench_threads[0];
+	size_t kept = 0;
+	size_t size;
+
+	for (size_t phase = 0; phase < BENCH_FRAG_PHASES; phase++) {
+		size = 16 + phase * 48;
+		for (size_t i = 0; i < BENCH_FRAG_OBJECTS; i++)
+			thread->slots[i] = bench_malloc(thread, size);
+		for (size_t i = 0; i < BENCH_FRAG_OBJECTS; i++) {
+			if (i % 2)
+				bench_free(thread, thread->slots[i]);
+			else
+				bench_kept[kept++] = thread->slots[i];
+		}
+	}
+	for (size_t i = 0; i < kept; i++)
+		bench_free(thread, bench_kept[i]);
+}
+
+static const bench_workload bench_workloads[] = {
+	{ "churn", bench_churn },
+	{ "random", bench_random_sizes },
+	{ "prodcons", bench_producer_consumer },
+	{ "larson", bench_larson },
+	{ "frag", bench_fragmentation },
+};
+
+#define BENCH_WORKLOADS (sizeof(bench_workloads) / sizeof(bench_workloads[0]))
+
+/**
+ * @brief Returns a latency percentile in nanoseconds.
+ *
+ * @param histogram The latency histogram.
+ * @param ops The number of latencies in the histogram.
+ * @param fraction The fraction of latencies at or below the percentile.
+ * @return The percentile in nanoseconds.
+ */
+static double bench_percentile(const uint64_t *histogram, uint64_t ops,
+			       double fraction)
+{
+	uint64_t rank = ops * fraction;
+	uint64_t seen = 0;
+	size_t i;
+
+	for (i = 0; i < BENCH_BUCKETS - 1; i++) {
+		seen += histogram[i];
+		if (seen > rank)
+			break;
+	}
+	return bench_bucket_limit(i) / bench_ticks_per_ns;
+}
+
+/**
+ * @brief Returns the peak memory use of the workload in KiB.
+ *
+ * @return The peak resident set of the process.
+ */
+static long bench_peak(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+/**
+ * @brief Runs a workload and prints its results. This is called in the
+ * child process of the workload.
+ *
+ * @param workload The workload.
+ */
+static void bench_measure(const bench_workload *workload)
+{
+	uint64_t histogram[BENCH_BUCKETS] = { 0 };
+	uint64_t ops = 0;
+	uint64_t max = 0;
+	double start;
+	double elapsed;
+
+	for (size_t i = 0; i < BENCH_THREADS; i++)
+		bench_threads[i].seed = 0x9e3779b97f4a7c15ull * (i + 1);
+	start = bench_time();
+	workload->run();
+	elapsed = bench_time() - start;
+
+	for (size_t i = 0; i < BENCH_THREADS; i++) {
+		for (size_t j = 0; j < BENCH_BUCKETS; j++)
+			histogram[j] += bench_threads[i].histogram[j];
+		ops += bench_threads[i].ops;
+		if (bench_threads[i].max > max)
+			max = bench_threads[i].max;
+	}
+	printf("%-10s %10llu %12.0f %8.0f %8.0f %8.0f %10.0f %13ld",
+	       workload->name, (unsigned long long)ops, ops / elapsed,
+	       bench_percentile(histogram, ops, 0.5),
+	       bench_percentile(histogram, ops, 0.99),
+	       bench_percentile(histogram, ops, 0.999),
+	       max / bench_ticks_per_ns, bench_peak());
+#ifndef BENCH_GLIBC
+	printf(" %13zu", mallinfo2().usmblks / 1024);
+#endif
+	printf("\n");
+}
+
+/**
+ * @brief Runs a workload in a child process.
+ *
+ * @param workload The workload.
+ * @return 0 on success, 1 if the workload failed.
+ */
+static int bench_run(const bench_workload *workload)
+{
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (!pid) {
+		bench_measure(workload);
+		fflush(stdout);
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0 || status) {
+		fprintf(stderr, "%s: failed\n", workload->name);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Runs the workloads named on the command line, or all of them.
+ *
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ * @return 0 on success, 1 if a workload is unknown or failed.
+ */
+int main(int argc, char **argv)
+{
+	int result = 0;
+	size_t i;
+
+	for (int arg = 1; arg < argc; arg++) {
+		for (i = 0; i < BENCH_WORKLOADS; i++)
+			if (!strcmp(argv[arg], bench_workloads[i].name))
+				break;
+		if (i == BENCH_WORKLOADS) {
+			fprintf(stderr, "usage: %s [WORKLOAD]...\n", argv[0]);
+			fprintf(stderr, "workloads:");
+			for (i = 0; i < BENCH_WORKLOADS; i++)
+				fprintf(stderr, " %s", bench_workloads[i].name);
+			fprintf(stderr, "\n");
+			return 1;
+		}
+	}
+
+	bench_ticks_per_ns = bench_calibrate();
+	printf("allocator: %s\n", BENCH_ALLOCATOR);
+	printf("%-10s %10s %12s %8s %8s %8s %10s %13s", "workload", "ops",
+	       "ops/sec", "p50 ns", "p99 ns", "p99.9 ns", "max ns",
+	       "peak RSS KiB");
+#ifndef BENCH_GLIBC
+	printf(" %13s", "peak heap KiB");
+#endif
+	printf("\n");
+	for (i = 0; i < BENCH_WORKLOADS; i++) {
+		int arg;
+
+		for (arg = 1; arg < argc; arg++)
+			if (!strcmp(argv[arg], bench_workloads[i].name))
+				break;
+		if (argc > 1 && arg == argc)
+			continue;
+		result |= bench_run(&bench_workloads[i]);
+	}
+	return result;
+}
@@ -0,0 +1,216 @@
+/**
+ * @file heap_replay.c
+ * @brief Replays an allocation trace on a Linux host.
+ *
+ * This program reads a trace made of the events reported by
+ * heap_trace_dump(), written one after another as heap_trace_event_t
+ * records, and makes the same calls to the allocator of c_core in the same
+ * order. It reports how long the calls took and how much memory the heap
+ * used, so that allocator changes can be compared on real workloads.
+ */
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Pointers from the trace are mapped to the pointers returned during the
+ * replay by a table using open addressing with linear probing. The table
+ * and the trace are mapped directly, so that they do not count towards the
+ * memory used by the heap.
+ */
+typedef struct _replay_entry replay_entry;
+struct _replay_entry {
+	void *traced;
+	void *ptr;
+};
+
+static replay_entry *replay_table;
+static size_t replay_mask;
+
+/**
+ * @brief Returns the home slot of a traced pointer in the table.
+ *
+ * @param traced The pointer from the trace.
+ * @return The index of the slot.
+ */
+static size_t replay_home(void *traced)
+{
+	uint64_t hash = (uintptr_t)traced * 0x9e3779b97f4a7c15ull;
+
+	return (hash ^ hash >> 29) & replay_mask;
+}
+
+/**
+ * @brief Records the pointer returned for a traced pointer.
+ *
+ * A traced pointer that is still in the table was freed by a call missing
+ * from the trace, so the memory it stands for is freed first.
+ *
+ * @param traced The pointer from the trace.
+ * @param ptr The pointer returned during the replay.
+ */
+static void replay_insert(void *traced, void *ptr)
+{
+	size_t index = replay_home(traced);
+
+	while (replay_table[index].traced &&
+	       replay_table[index].traced != traced)
+		index = (index + 1) & replay_mask;
+	if (replay_table[index].traced)
+		free(replay_table[index].ptr);
+	replay_table[index].traced = traced;
+	replay_table[index].ptr = ptr;
+}
+
+/**
+ * @brief Removes a traced pointer from the table.
+ *
+ * Entries after the removed one are moved back so that no probe sequence
+ * is broken.
+ *
+ * @param traced The pointer from the trace.
+ * @return The pointer returned during the replay, or NULL if the traced
+ * pointer is not in the table.
+ */
+static void *replay_remove(void *traced)
+{
+	size_t index = replay_home(traced);
+	size_t next;
+	size_t home;
+	void *ptr;
+
+	while (replay_table[index].traced != traced) {
+		if (!replay_table[index].traced)
+			return NULL;
+		index = (index + 1) & replay_mask;
+	}
+	ptr = replay_table[index].ptr;
+
+	next = index;
+	while (1) {
+		next = (next + 1) & replay_mask;
+		if (!replay_table[next].traced)
+			break;
+		home = replay_home(replay_table[next].traced);
+		if (((next - home) & replay_mask) <
+		    ((next - index) & replay_mask))
+			continue;
+		replay_table[index] = replay_table[next];
+		index = next;
+	}
+	replay_table[index].traced = NULL;
+	return ptr;
+}
+
+/**
+ * @brief Makes the call to the allocator that an event describes.
+ *
+ * @param event Pointer to the event.
+ */
+static void replay_event(const heap_trace_event_t *event)
+{
+	void *ptr;
+
+	switch (event->op) {
+	case HEAP_TRACE_MALLOC:
+		ptr = malloc(event->size);
+		break;
+	case HEAP_TRACE_CALLOC:
+		ptr = calloc(1, event->size);
+		break;
+	case HEAP_TRACE_REALLOC:
+		ptr = realloc(replay_remove(event->old), event->size);
+		break;
+	case HEAP_TRACE_ALIGNED:
+		ptr = aligned_alloc(event->alignment, event->size);
+		break;
+	case HEAP_TRACE_FREE:
+		free(replay_remove(event->ptr));
+		return;
+	default:
+		return;
+	}
+	if (ptr)
+		replay_insert(event->ptr, ptr);
+}
+
+/**
+ * @brief Returns the time of a monotonic clock in seconds.
+ *
+ * @return The time in seconds.
+ */
+static double replay_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Replays the trace named on the command line.
+ *
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ * @return 0 on success, 1 if the trace cannot be read.
+ */
+int main(int argc, char **argv)
+{
+	const heap_trace_event_t *events;
+	struct mallinfo2 info;
+	struct stat st;
+	size_t count;
+	size_t live = 0;
+	double start;
+	double elapsed;
+	int fd;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s TRACE\n", argv[0]);
+		return 1;
+	}
+	if ((fd = open(argv[1], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	count = st.st_size / sizeof(heap_trace_event_t);
+	if (!count) {
+		fprintf(stderr, "%s: empty trace\n", argv[1]);
+		return 1;
+	}
+	events = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	for (replay_mask = 1; replay_mask < 2 * count; replay_mask <<= 1)
+		;
+	replay_table = mmap(NULL, replay_mask * sizeof(replay_entry),
+			    PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (events == MAP_FAILED || replay_table == MAP_FAILED) {
+		perror(argv[1]);
+		return 1;
+	}
+	replay_mask--;
+
+	start = replay_time();
+	for (size_t i = 0; i < count; i++)
+		replay_event(&events[i]);
+	elapsed = replay_time() - start;
+	info = mallinfo2();
+
+	for (size_t i = 0; i <= replay_mask; i++)
+		live += !!replay_table[i].traced;
+	printf("events:       %zu\n", count);
+	printf("traced time:  %llu cycles\n",
+	       events[count - 1].time - events[0].time);
+	printf("replay time:  %.6f s\n", elapsed);
+	printf("ops/sec:      %.0f\n", count / elapsed);
+	printf("peak heap:    %zu bytes\n", info.usmblks);
+	printf("heap regions: %zu bytes\n", info.arena);
+	printf("live blocks:  %zu\n", live);
+	return 0;
+}